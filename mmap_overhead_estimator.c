@@ -3,17 +3,88 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h> // mmap, munmap, MAP_*, PROT_*, MADV_*
+#include <linux/mman.h> // MAP_HUGE_2MB, MAP_HUGE_1GB (not exported by older glibc headers)
+#include <linux/memfd.h> // MFD_HUGE_2MB, MFD_HUGE_1GB
 #include <unistd.h>   // sysconf, getpid
 #include <fcntl.h>    // open
 #include <errno.h>
 #include <inttypes.h> // PRIu64
-#include <limits.h>   // ULLONG_MAX
+#include <limits.h>   // ULLONG_MAX, PATH_MAX
+#include <getopt.h>   // getopt_long
+#include <time.h>     // clock_gettime
+#include <dirent.h>   // opendir (NUMA node enumeration)
+#include <signal.h>   // sigaction (pool rollback on SIGINT/SIGTERM, SIGBUS on touch)
+#include <setjmp.h>   // sigsetjmp (recover from SIGBUS while touching)
+#include <sys/stat.h> // mkdir (per-run cgroup), fstat
+#include <sys/wait.h> // waitpid
+#include <sys/vfs.h>  // statfs (hugetlbfs/tmpfs detection)
+#include <linux/magic.h> // HUGETLBFS_MAGIC, TMPFS_MAGIC
+#include <sys/ipc.h>
+#include <sys/shm.h>  // shmget, shmat, SHM_HUGETLB
+#include <sys/resource.h> // getrusage (page fault counts)
+#include <sys/sysmacros.h> // major, minor (block device of a file)
+#include <pthread.h>  // I/O worker threads
+#include <sched.h>    // sched_yield
+#include <sys/syscall.h> // io_uring_* (no liburing needed)
+#include <sys/uio.h>  // struct iovec
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h> // iTLB miss counter
+#include <linux/fs.h>   // PAGEMAP_SCAN
+#include <linux/userfaultfd.h>
+#include <poll.h>
 
 // Define common page sizes
 #define PAGE_SIZE_4K (4UL * 1024)
 #define PAGE_SIZE_2M (2UL * 1024 * 1024)
 #define PAGE_SIZE_1G (1UL * 1024 * 1024 * 1024)
 
+// Huge page size encoding for shmget (same bits as MAP_HUGE_*; glibc only has them in linux/shm.h)
+#ifndef SHM_HUGE_2MB
+#define SHM_HUGE_2MB HUGETLB_FLAG_ENCODE_2MB
+#define SHM_HUGE_1GB HUGETLB_FLAG_ENCODE_1GB
+#endif
+
+// Synchronous THP collapse (Linux 6.1+), missing from older headers
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+// PAGEMAP_SCAN ioctl on /proc/<pid>/pagemap (Linux 6.7+), missing from older headers
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_WPALLOWED (1 << 0)
+#define PAGE_IS_WRITTEN   (1 << 1)
+#define PAGE_IS_FILE      (1 << 2)
+#define PAGE_IS_PRESENT   (1 << 3)
+#define PAGE_IS_SWAPPED   (1 << 4)
+#define PAGE_IS_PFNZERO   (1 << 5)
+#define PAGE_IS_HUGE      (1 << 6)
+#define PAGE_IS_SOFT_DIRTY (1 << 7)
+
+struct page_region {
+    uint64_t start;
+    uint64_t end;
+    uint64_t categories;
+};
+
+struct pm_scan_arg {
+    uint64_t size;
+    uint64_t flags;
+    uint64_t start;
+    uint64_t end;
+    uint64_t walk_end;
+    uint64_t vec;
+    uint64_t vec_len;
+    uint64_t max_pages;
+    uint64_t category_inverted;
+    uint64_t category_mask;
+    uint64_t category_anyof_mask;
+    uint64_t return_mask;
+};
+
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#endif
+
 // Size of a Page Table Entry (PTE)
 #define PTE_SIZE 8
 
@@ -25,6 +96,16 @@ typedef enum {
     MODE_1G  // Explicit HugeTLB 1GB
 } PageSizeMode;
 
+// Everything derived from the <mode> argument
+typedef struct {
+    PageSizeMode mode;
+    const char *name;        // Mode argument as given ("4k", "thp", "2m", "1g")
+    const char *description; // Printed as "Mode: ..."
+    int mmap_flags;          // MAP_HUGETLB | MAP_HUGE_* for the HugeTLB modes, 0 otherwise
+    size_t huge_page_size;   // Relevant for HugeTLB modes, 0 otherwise
+    size_t touch_step_size;  // Stride that faults in every page exactly once
+} ModeConfig;
+
 // --- Helper Functions ---
 
 // Helper function to parse size strings like "1G", "512M", "1024K"
@@ -80,8 +161,38 @@ size_t parse_size(const char *size_str) {
     return final_size;
 }
 
-// Helper function to read VmPTE from /proc/self/status
-long get_vmpte_kb() {
+// Read a single integer from a sysfs/procfs file. Returns -1 on error.
+long long read_ll_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    long long val = -1;
+    if (fscanf(f, "%lld", &val) != 1) val = -1;
+    fclose(f);
+    return val;
+}
+
+// Write a string to a sysfs/procfs/cgroupfs file with a single write(), so the
+// kernel sees it as one command. Only uses async-signal-safe calls.
+int write_str_file(const char *path, const char *str) {
+    size_t len = strlen(str);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) return -1;
+    ssize_t written = write(fd, str, len);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return written == (ssize_t)len ? 0 : -1;
+}
+
+// Write a single integer to a sysfs/procfs file
+int write_ll_file(const char *path, long long val) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld\n", val);
+    return write_str_file(path, buf);
+}
+
+// Helper function to read a "Key: <value> kB" field from /proc/self/status
+long get_status_kb(const char *key) {
     static char proc_path[64];
     snprintf(proc_path, sizeof(proc_path), "/proc/%d/status", getpid());
 
@@ -92,21 +203,334 @@ long get_vmpte_kb() {
     }
 
     char line[256];
-    long vmpte = -1;
+    size_t key_len = strlen(key);
+    long value = -1;
     while (fgets(line, sizeof(line), f)) {
-        if (strncmp(line, "VmPTE:", 6) == 0) {
-            if (sscanf(line + 6, "%ld", &vmpte) == 1) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            if (sscanf(line + key_len + 1, "%ld", &value) == 1) {
                 break; // Found it
             } else {
                 // Suppress warning here, return -1 indicates failure
-                vmpte = -1;
+                value = -1;
                 break;
             }
         }
     }
     fclose(f);
-    // If vmpte is still -1 here, it means not found or parse error
-    return vmpte; // Returns value in kB, or -1 on error/not found
+    // If value is still -1 here, it means not found or parse error
+    return value; // Returns value in kB, or -1 on error/not found
+}
+
+// Helper function to read VmPTE from /proc/self/status
+long get_vmpte_kb() {
+    return get_status_kb("VmPTE");
+}
+
+// Helper function to read a field (in kB) from /proc/meminfo, e.g. "PageTables"
+long get_meminfo_kb(const char *key) {
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (!f) return -1;
+
+    char line[256];
+    size_t key_len = strlen(key);
+    long value = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            if (sscanf(line + key_len + 1, "%ld", &value) != 1) value = -1;
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Read a field (in kB) of the /proc/self/smaps entry of the mapping starting at addr
+long get_smaps_kb(void *addr, const char *key) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) return -1;
+
+    char line[512];
+    size_t key_len = strlen(key);
+    int in_vma = 0;
+    long value = -1;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end;
+        // VMA header lines look like "7f0000000000-7f0000200000 rw-s ..."
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            if (in_vma) break;
+            in_vma = (start == (unsigned long)addr);
+            continue;
+        }
+        if (in_vma && strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            if (sscanf(line + key_len + 1, "%ld", &value) != 1) value = -1;
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Sum of a field (in kB) over all /proc/self/smaps entries whose VMA starts
+// within [addr, addr + len), for ranges that span several VMAs
+long get_smaps_range_kb(void *addr, size_t len, const char *key) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) return -1;
+
+    char line[512];
+    size_t key_len = strlen(key);
+    int in_range = 0;
+    long total = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_range = start >= (unsigned long)addr && start < (unsigned long)addr + len;
+            continue;
+        }
+        long value;
+        if (in_range && strncmp(line, key, key_len) == 0 && line[key_len] == ':' &&
+            sscanf(line + key_len + 1, "%ld", &value) == 1) {
+            total += value;
+        }
+    }
+    fclose(f);
+    return total;
+}
+
+// Number of VMAs of this process (lines of /proc/self/maps), or -1 on error
+long count_vmas() {
+    FILE *f = fopen("/proc/self/maps", "r");
+    if (!f) return -1;
+    long count = 0;
+    int c, last = '\n';
+    while ((c = getc(f)) != EOF) {
+        if (c == '\n') count++;
+        last = c;
+    }
+    if (last != '\n') count++;
+    fclose(f);
+    return count;
+}
+
+// Read a counter from /proc/vmstat. Returns -1 if the kernel does not have it
+// (several are only built with debug options).
+long long get_vmstat(const char *key) {
+    FILE *f = fopen("/proc/vmstat", "r");
+    if (!f) return -1;
+    char name[64];
+    long long value, result = -1;
+    while (fscanf(f, "%63s %lld", name, &value) == 2) {
+        if (strcmp(name, key) == 0) {
+            result = value;
+            break;
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+// TLB shootdown IPIs received so far, summed over all CPUs (the "TLB:" line of
+// /proc/interrupts, x86 only). Returns -1 if there is no such line.
+long long get_tlb_shootdowns() {
+    FILE *f = fopen("/proc/interrupts", "r");
+    if (!f) return -1;
+    char line[4096];
+    long long total = -1;
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line;
+        while (*p == ' ') p++;
+        if (strncmp(p, "TLB:", 4) != 0) continue;
+        p += 4;
+        total = 0;
+        char *end;
+        for (long long v = strtoll(p, &end, 10); end != p; v = strtoll(p, &end, 10)) {
+            total += v;
+            p = end;
+        }
+        break;
+    }
+    fclose(f);
+    return total;
+}
+
+// Memory of a slab cache in kB (slabs x pages per slab) from /proc/slabinfo,
+// or -1 if it is not readable or the cache was merged into another one
+long get_slab_kb(const char *cache) {
+    FILE *f = fopen("/proc/slabinfo", "r");
+    if (!f) return -1;
+    char line[512];
+    size_t len = strlen(cache);
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, cache, len) != 0 || line[len] != ' ') continue;
+        long active, num, objsize, per_slab, pages_per_slab, active_slabs, num_slabs;
+        if (sscanf(line + len, "%ld %ld %ld %ld %ld : tunables %*d %*d %*d : slabdata %ld %ld",
+                   &active, &num, &objsize, &per_slab, &pages_per_slab, &active_slabs, &num_slabs) == 7) {
+            kb = num_slabs * pages_per_slab * (long)(PAGE_SIZE_4K / 1024);
+        }
+        break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// Minor and major page faults of this process so far
+void get_fault_counts(long *minor, long *major) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) {
+        *minor = *major = 0;
+        return;
+    }
+    *minor = ru.ru_minflt;
+    *major = ru.ru_majflt;
+}
+
+// Number of 4kB pages in [addr, addr + size) whose /proc/self/pagemap entry
+// has the given bit set (63: present, 55: soft-dirty), or -1 on error
+long count_pagemap_bit(void *addr, size_t size, int bit) {
+    int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    uint64_t entries[512];
+    size_t first = (uintptr_t)addr / PAGE_SIZE_4K;
+    size_t pages = size / PAGE_SIZE_4K;
+    long present = 0;
+    for (size_t done = 0; done < pages; ) {
+        size_t batch = pages - done < 512 ? pages - done : 512;
+        ssize_t n = pread(fd, entries, batch * sizeof(uint64_t), (off_t)((first + done) * sizeof(uint64_t)));
+        if (n <= 0) {
+            present = -1;
+            break;
+        }
+        for (size_t i = 0; i < (size_t)n / sizeof(uint64_t); i++) {
+            if ((entries[i] >> bit) & 1) present++;
+        }
+        done += (size_t)n / sizeof(uint64_t);
+    }
+    close(fd);
+    return present;
+}
+
+// Number of 4kB pages in [addr, addr + size) that have a present PTE, or -1 on error
+long count_present_pages(void *addr, size_t size) {
+    return count_pagemap_bit(addr, size, 63);
+}
+
+// Pages of a range by category, in 4kB pages
+typedef struct {
+    long present;
+    long huge;     // Mapped by a huge PMD or HugeTLB entry
+    long written;  // Soft-dirty: written since the last clear_refs
+    long regions;  // Ranges PAGEMAP_SCAN returned
+    long calls;    // ioctl or pread calls
+    int via_ioctl; // 0: read() of every pagemap entry
+} PageClasses;
+
+// Classify the present pages of [addr, addr + size) with the PAGEMAP_SCAN
+// ioctl, which returns merged ranges instead of one entry per page.
+// Returns 0, or -1 with errno set (ENOTTY or EINVAL: kernel older than 6.7).
+int pagemap_scan_classify(void *addr, size_t size, PageClasses *pc) {
+    int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct page_region regions[1024];
+    struct pm_scan_arg arg;
+    uint64_t end = (uintptr_t)addr + size;
+    memset(pc, 0, sizeof(*pc));
+    pc->via_ioctl = 1;
+    for (uint64_t start = (uintptr_t)addr; start < end; ) {
+        memset(&arg, 0, sizeof(arg));
+        arg.size = sizeof(arg);
+        arg.start = start;
+        arg.end = end;
+        arg.vec = (uintptr_t)regions;
+        arg.vec_len = sizeof(regions) / sizeof(regions[0]);
+        arg.category_mask = PAGE_IS_PRESENT;
+        arg.return_mask = PAGE_IS_PRESENT | PAGE_IS_HUGE | PAGE_IS_SOFT_DIRTY;
+        int n = ioctl(fd, PAGEMAP_SCAN, &arg);
+        if (n < 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        pc->calls++;
+        pc->regions += n;
+        for (int i = 0; i < n; i++) {
+            long pages = (long)((regions[i].end - regions[i].start) / PAGE_SIZE_4K);
+            pc->present += pages;
+            if (regions[i].categories & PAGE_IS_HUGE) pc->huge += pages;
+            if (regions[i].categories & PAGE_IS_SOFT_DIRTY) pc->written += pages;
+        }
+        // Some kernels report a walk_end short of the ranges they returned;
+        // continue behind both so that no page is counted twice
+        uint64_t next = arg.walk_end;
+        if (n > 0 && regions[n - 1].end > next) next = regions[n - 1].end;
+        if (next <= start) break;
+        start = next;
+    }
+    close(fd);
+    return 0;
+}
+
+// Same classification from a read() of every pagemap entry: present is bit 63,
+// written is bit 55 (soft-dirty). Huge pages come from smaps.
+int pagemap_read_classify(void *addr, size_t size, PageClasses *pc) {
+    int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    uint64_t entries[4096];
+    size_t first = (uintptr_t)addr / PAGE_SIZE_4K;
+    size_t pages = size / PAGE_SIZE_4K;
+    memset(pc, 0, sizeof(*pc));
+    for (size_t done = 0; done < pages; ) {
+        size_t batch = pages - done < 4096 ? pages - done : 4096;
+        ssize_t n = pread(fd, entries, batch * sizeof(uint64_t), (off_t)((first + done) * sizeof(uint64_t)));
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        pc->calls++;
+        for (size_t i = 0; i < (size_t)n / sizeof(uint64_t); i++) {
+            if (!(entries[i] >> 63)) continue;
+            pc->present++;
+            if ((entries[i] >> 55) & 1) pc->written++;
+        }
+        done += (size_t)n / sizeof(uint64_t);
+    }
+    close(fd);
+    long huge_kb = 0;
+    const char *keys[] = {"AnonHugePages", "ShmemPmdMapped", "FilePmdMapped", "Private_Hugetlb", "Shared_Hugetlb"};
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        long kb = get_smaps_range_kb(addr, size, keys[i]);
+        if (kb > 0) huge_kb += kb;
+    }
+    pc->huge = huge_kb / 4;
+    return 0;
+}
+
+// PAGEMAP_SCAN where the kernel has it, read() of pagemap otherwise
+int classify_pages(void *addr, size_t size, PageClasses *pc) {
+    if (pagemap_scan_classify(addr, size, pc) == 0) return 0;
+    if (errno != ENOTTY && errno != EINVAL) return -1;
+    return pagemap_read_classify(addr, size, pc);
+}
+
+// System-wide page table memory from /proc/meminfo. The counter is kept in
+// per-CPU deltas that can lag by hundreds of kB, so fold them first (root only).
+long get_pagetables_kb() {
+    write_str_file("/proc/sys/vm/stat_refresh", "1");
+    return get_meminfo_kb("PageTables");
+}
+
+// PageTables once page tables of exited processes have really been freed.
+// Freeing can be deferred (RCU), so wait until two readings agree.
+long get_settled_pagetables_kb() {
+    long prev = get_pagetables_kb();
+    for (int i = 0; i < 50; i++) {
+        usleep(20000);
+        long cur = get_pagetables_kb();
+        if (cur == prev) break;
+        prev = cur;
+    }
+    return prev;
 }
 
 // Function to calculate theoretical overhead (PTEs only)
@@ -134,180 +558,4538 @@ ThpStatus check_thp_status() {
     return status;
 }
 
-// --- Main Logic ---
+// Shared memory THP policy (/sys/kernel/mm/transparent_hugepage/shmem_enabled).
+// It covers the internal shmem mount (MAP_SHARED|MAP_ANONYMOUS, memfd, SysV);
+// tmpfs mounts follow their huge= option unless 'deny' or 'force' is set.
+typedef enum {
+    SHMEM_THP_UNKNOWN, SHMEM_THP_ALWAYS, SHMEM_THP_WITHIN_SIZE, SHMEM_THP_ADVISE,
+    SHMEM_THP_NEVER, SHMEM_THP_DENY, SHMEM_THP_FORCE
+} ShmemThpStatus;
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <size[K|M|G]> <mode:4k|thp|2m|1g>\n", argv[0]);
-        fprintf(stderr, "  size: Mapping size (e.g., 1G, 256M)\n");
-        fprintf(stderr, "  mode: Page size strategy\n");
-        fprintf(stderr, "    4k:  Attempt 4KB pages (using madvise hint)\n");
-        fprintf(stderr, "    thp: Standard anonymous mapping (allow Transparent Huge Pages)\n");
-        fprintf(stderr, "    2m:  Explicit 2MB HugeTLB pages (requires configuration)\n");
-        fprintf(stderr, "    1g:  Explicit 1GB HugeTLB pages (requires configuration)\n");
-        fprintf(stderr, "\nExample: %s 1G 2m\n", argv[0]);
-        return 1;
+const char *shmem_thp_names[] = {"unknown", "always", "within_size", "advise", "never", "deny", "force"};
+
+ShmemThpStatus check_shmem_thp_status() {
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+    if (!f) return SHMEM_THP_UNKNOWN;
+
+    char line[256];
+    ShmemThpStatus status = SHMEM_THP_UNKNOWN;
+    if (fgets(line, sizeof(line), f)) {
+        for (int i = SHMEM_THP_ALWAYS; i <= SHMEM_THP_FORCE; i++) {
+            char token[32];
+            snprintf(token, sizeof(token), "[%s]", shmem_thp_names[i]);
+            if (strstr(line, token)) { status = (ShmemThpStatus)i; break; }
+        }
     }
+    fclose(f);
+    return status;
+}
 
-    // --- Parse Arguments ---
-    size_t map_size = parse_size(argv[1]);
-    if (map_size == 0) {
-        return 1; // Error message already printed
+// Find the mount that contains path in /proc/mounts (longest matching mount point).
+// Fills fstype and the value of the huge= option ("never" if absent). Returns 0 if found.
+int get_mount_huge_option(const char *path, char *fstype, size_t fstype_len, char *huge, size_t huge_len) {
+    char real[PATH_MAX];
+    if (!realpath(path, real)) {
+        // The file may not exist yet; its directory decides the mount
+        char dir_buf[PATH_MAX];
+        snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+        char *slash = strrchr(dir_buf, '/');
+        if (slash == dir_buf) slash[1] = '\0';
+        else if (slash) *slash = '\0';
+        else snprintf(dir_buf, sizeof(dir_buf), ".");
+        if (!realpath(dir_buf, real)) return -1;
     }
+    FILE *f = fopen("/proc/mounts", "r");
+    if (!f) return -1;
 
-    PageSizeMode mode;
-    int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
-    size_t huge_page_size = 0; // Relevant for HugeTLB modes
-    size_t touch_step_size = PAGE_SIZE_4K; // Default step for touching
-
-    if (strcmp(argv[2], "4k") == 0) {
-        mode = MODE_4K;
-        printf("Mode: Attempting 4KB pages (using MADV_NOHUGEPAGE hint)\n");
-    } else if (strcmp(argv[2], "thp") == 0) {
-        mode = MODE_THP;
-        printf("Mode: Standard anonymous mapping (allowing THP)\n");
-    } else if (strcmp(argv[2], "2m") == 0) {
-        mode = MODE_2M;
-        mmap_flags |= MAP_HUGETLB | MAP_HUGE_2MB;
-        huge_page_size = PAGE_SIZE_2M;
-        touch_step_size = PAGE_SIZE_2M;
-        printf("Mode: Explicit 2MB HugeTLB pages\n");
-    } else if (strcmp(argv[2], "1g") == 0) {
-        mode = MODE_1G;
-        mmap_flags |= MAP_HUGETLB | MAP_HUGE_1GB;
-        huge_page_size = PAGE_SIZE_1G;
-        touch_step_size = PAGE_SIZE_1G;
-        printf("Mode: Explicit 1GB HugeTLB pages\n");
-    } else {
-        fprintf(stderr, "Error: Invalid mode '%s'. Use 4k, thp, 2m, or 1g.\n", argv[2]);
-        return 1;
+    char dev[256], dir[PATH_MAX], type[64], opts[1024];
+    size_t best_len = 0;
+    int found = -1;
+    while (fscanf(f, "%255s %4095s %63s %1023s %*d %*d", dev, dir, type, opts) == 4) {
+        size_t len = strlen(dir);
+        int prefix = strncmp(real, dir, len) == 0 &&
+                     (real[len] == '/' || real[len] == '\0' || strcmp(dir, "/") == 0);
+        if (!prefix || len < best_len) continue;
+        best_len = len;
+        found = 0;
+        snprintf(fstype, fstype_len, "%s", type);
+        snprintf(huge, huge_len, "never");
+        char *save = NULL;
+        for (char *tok = strtok_r(opts, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+            if (strncmp(tok, "huge=", 5) == 0) snprintf(huge, huge_len, "%s", tok + 5);
+        }
     }
+    fclose(f);
+    return found;
+}
 
-    // --- Pre-mmap Checks ---
-    if ((mode == MODE_2M || mode == MODE_1G) && (map_size % huge_page_size != 0)) {
-        fprintf(stderr, "Error: Mapping size %zu bytes must be a multiple of the huge page size (%zu bytes) for mode %s.\n",
-                map_size, huge_page_size, argv[2]);
-        return 1;
+// Parse the <mode> argument. Returns 0 on success, -1 for an unknown mode.
+int parse_mode(const char *arg, ModeConfig *mc) {
+    memset(mc, 0, sizeof(*mc));
+    mc->name = arg;
+    mc->touch_step_size = PAGE_SIZE_4K; // Default step for touching
+    if (strcmp(arg, "4k") == 0) {
+        mc->mode = MODE_4K;
+        mc->description = "Attempting 4KB pages (using MADV_NOHUGEPAGE hint)";
+    } else if (strcmp(arg, "thp") == 0) {
+        mc->mode = MODE_THP;
+        mc->description = "Standard anonymous mapping (allowing THP)";
+    } else if (strcmp(arg, "2m") == 0) {
+        mc->mode = MODE_2M;
+        mc->mmap_flags = MAP_HUGETLB | MAP_HUGE_2MB;
+        mc->huge_page_size = PAGE_SIZE_2M;
+        mc->touch_step_size = PAGE_SIZE_2M;
+        mc->description = "Explicit 2MB HugeTLB pages";
+    } else if (strcmp(arg, "1g") == 0) {
+        mc->mode = MODE_1G;
+        mc->mmap_flags = MAP_HUGETLB | MAP_HUGE_1GB;
+        mc->huge_page_size = PAGE_SIZE_1G;
+        mc->touch_step_size = PAGE_SIZE_1G;
+        mc->description = "Explicit 1GB HugeTLB pages";
+    } else {
+        return -1;
     }
+    return 0;
+}
 
-    ThpStatus thp_status = check_thp_status();
-    if ((mode == MODE_4K || mode == MODE_THP) && thp_status == THP_NEVER) {
-        printf("Warning: System THP is set to 'never'. Kernel will likely use 4KB pages.\n");
+// --- Mapping Backends ---
+
+// How a file-backed mapping is opened and mapped (--file, --prefill, --map-private, --read-only)
+typedef struct {
+    const char *path;
+    int prefill;      // Write data into a newly created file instead of leaving it sparse
+    int map_private;  // MAP_PRIVATE instead of MAP_SHARED
+    int read_only;    // O_RDONLY + PROT_READ; the touch loop only reads
+} FileOptions;
+
+// Where the memory of a test mapping comes from
+typedef enum {
+    BACKING_PRIVATE, // MAP_PRIVATE | MAP_ANONYMOUS (default)
+    BACKING_SHARED,  // MAP_SHARED | MAP_ANONYMOUS (shmem, or hugetlb for 2m/1g)
+    BACKING_MEMFD,   // MAP_SHARED of a memfd (MFD_HUGETLB for 2m/1g)
+    BACKING_TMPFS,   // MAP_SHARED of a file on a tmpfs mount (--file)
+    BACKING_SYSV,    // SysV shared memory segment (shmget/shmat, SHM_HUGETLB for 2m/1g)
+    BACKING_FILE     // Regular file (--file), page cache backed
+} Backing;
+
+const char *backing_name(Backing backing) {
+    switch (backing) {
+        case BACKING_PRIVATE: return "private";
+        case BACKING_SHARED: return "shared";
+        case BACKING_MEMFD: return "memfd";
+        case BACKING_TMPFS: return "tmpfs";
+        case BACKING_SYSV: return "sysv";
+        case BACKING_FILE: return "file";
     }
-    if (mode == MODE_THP && thp_status == THP_UNKNOWN) {
-        printf("Warning: Could not determine system THP status.\n");
+    return "?";
+}
+
+int parse_backing(const char *arg, Backing *backing) {
+    if (strcmp(arg, "private") == 0) *backing = BACKING_PRIVATE;
+    else if (strcmp(arg, "shared") == 0) *backing = BACKING_SHARED;
+    else if (strcmp(arg, "memfd") == 0) *backing = BACKING_MEMFD;
+    else if (strcmp(arg, "tmpfs") == 0) *backing = BACKING_TMPFS;
+    else if (strcmp(arg, "sysv") == 0) *backing = BACKING_SYSV;
+    else if (strcmp(arg, "file") == 0) *backing = BACKING_FILE;
+    else return -1;
+    return 0;
+}
+
+// mmap flags used for a mode/backing combination
+int region_mmap_flags(const ModeConfig *mc, Backing backing, int extra_flags, const FileOptions *file) {
+    switch (backing) {
+        case BACKING_PRIVATE: return MAP_PRIVATE | MAP_ANONYMOUS | mc->mmap_flags | extra_flags;
+        case BACKING_SHARED:  return MAP_SHARED | MAP_ANONYMOUS | mc->mmap_flags | extra_flags;
+        case BACKING_MEMFD:
+        case BACKING_TMPFS:   return MAP_SHARED | (extra_flags & MAP_NORESERVE);
+        case BACKING_SYSV:    return 0; // Not mapped with mmap
+        case BACKING_FILE:    return (file && file->map_private ? MAP_PRIVATE : MAP_SHARED) |
+                                     (extra_flags & MAP_NORESERVE);
     }
+    return 0;
+}
 
+// Whether a backing lives in shmem (and is governed by shmem THP settings)
+int backing_is_shmem(Backing backing) {
+    return backing == BACKING_SHARED || backing == BACKING_MEMFD || backing == BACKING_TMPFS ||
+           backing == BACKING_SYSV;
+}
 
-    // --- Get baseline VmPTE ---
-    long vmpte_before = get_vmpte_kb();
-    if (vmpte_before < 0) {
-        fprintf(stderr, "Error: Could not get initial VmPTE from /proc/self/status. Aborting.\n");
-        return 1;
+// Print the THP policy that applies to a shmem backing and warn when it
+// contradicts the requested mode
+void report_shmem_thp_policy(const ModeConfig *mc, Backing backing, const char *path) {
+    ShmemThpStatus status = check_shmem_thp_status();
+    char effective[32];
+    printf("Shmem THP: shmem_enabled [%s]\n", shmem_thp_names[status]);
+    if (backing == BACKING_TMPFS && path) {
+        char fstype[64], huge[32];
+        if (get_mount_huge_option(path, fstype, sizeof(fstype), huge, sizeof(huge)) != 0) {
+            return; // File may not exist yet; map_region() reports the real error
+        }
+        printf("Shmem THP: %s is on %s mounted with huge=%s\n", path, fstype, huge);
+        snprintf(effective, sizeof(effective), "%s", huge);
+    } else {
+        snprintf(effective, sizeof(effective), "%s", shmem_thp_names[status]);
     }
-    printf("Initial VmPTE: %ld kB\n", vmpte_before);
-    printf("Mapping size: %zu bytes (%.2f MB / %.2f GB)\n",
-           map_size, (double)map_size / (1024*1024), (double)map_size / (1024*1024*1024));
+    // 'deny' and 'force' override every mount and advice
+    if (status == SHMEM_THP_DENY) snprintf(effective, sizeof(effective), "never");
+    if (status == SHMEM_THP_FORCE) snprintf(effective, sizeof(effective), "always");
 
-    // --- mmap the memory ---
-    printf("--- Mapping Memory ---\n");
-    errno = 0;
-    void *addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
+    if (mc->mode == MODE_THP && (strcmp(effective, "never") == 0 || strcmp(effective, "deny") == 0)) {
+        printf("Warning: Shmem THP policy is '%s'. Kernel will use 4KB pages.\n", effective);
+    } else if (mc->mode == MODE_THP && strcmp(effective, "advise") == 0) {
+        printf("Shmem THP: policy 'advise', applying MADV_HUGEPAGE\n");
+    } else if (mc->mode == MODE_4K && status == SHMEM_THP_FORCE) {
+        printf("Warning: shmem_enabled is 'force'; MADV_NOHUGEPAGE is ignored.\n");
+    }
+}
 
-    if (addr == MAP_FAILED) {
-        int err = errno; // Capture errno immediately
-        fprintf(stderr, "Error: mmap failed: %s (errno %d)\n", strerror(err), err);
-        if ((mode == MODE_2M || mode == MODE_1G)) {
-            if (err == ENOMEM) {
-                fprintf(stderr, "  Hint: This often means insufficient HugeTLB pages are configured.\n");
-                fprintf(stderr, "        Check/increase '/proc/sys/vm/nr_hugepages' (for default size)\n");
-                fprintf(stderr, "        or '/sys/kernel/mm/hugepages/hugepages-%zukB/nr_hugepages' (for specific size).\n", huge_page_size / 1024);
-                fprintf(stderr, "        Ensure enough contiguous memory is available.\n");
-            } else if (err == EINVAL) {
-                fprintf(stderr, "  Hint: Check if mapping size (%zu) is a multiple of huge page size (%zu),\n", map_size, huge_page_size);
-                fprintf(stderr, "        or if the system supports HugeTLB pages of this size.\n");
-                fprintf(stderr, "        Flags used: 0x%x\n", mmap_flags);
+// Open --file for --backing=file|tmpfs and the file-backed scenarios. An
+// existing file is never modified and must be at least size bytes; a new one
+// is created sparse, or written out with --prefill, and unlinked right away
+// (the descriptor keeps it alive). Returns the descriptor or -1.
+int open_data_file(const FileOptions *file, size_t size) {
+    int fd = open(file->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        unlink(file->path);
+        if (file->prefill) {
+            char *buf = malloc(1024 * 1024);
+            if (!buf) {
+                close(fd);
+                errno = ENOMEM;
+                return -1;
+            }
+            memset(buf, 0x5a, 1024 * 1024);
+            for (size_t off = 0; off < size; ) {
+                size_t chunk = size - off < 1024 * 1024 ? size - off : 1024 * 1024;
+                ssize_t n = pwrite(fd, buf, chunk, (off_t)off);
+                if (n <= 0) {
+                    int err = n < 0 ? errno : EIO;
+                    free(buf);
+                    close(fd);
+                    errno = err;
+                    return -1;
+                }
+                off += (size_t)n;
             }
+            free(buf);
+        } else if (ftruncate(fd, (off_t)size) != 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
         }
-        return 1;
+        if (file->read_only) {
+            // READ_ONLY_THP_FOR_FS only collapses clean files that nobody has
+            // open for writing: flush, then swap in a read-only descriptor
+            // (the unlinked file is still reachable through /proc/self/fd)
+            char fd_path[64];
+            fdatasync(fd);
+            snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+            int ro = open(fd_path, O_RDONLY | O_CLOEXEC);
+            int err = errno;
+            close(fd);
+            errno = err;
+            fd = ro;
+        }
+        return fd;
     }
+    if (errno != EEXIST) return -1;
 
-    // --- Apply madvise hints (after successful mmap) ---
-    if (mode == MODE_4K) {
-        if (madvise(addr, map_size, MADV_NOHUGEPAGE) == -1) {
+    fd = open(file->path, (file->read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < size) {
+        fprintf(stderr, "Error: %s is smaller than the mapping size (%zu bytes).\n", file->path, size);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    return fd;
+}
+
+// shmget flags used for a mode (huge page size encoded like MAP_HUGE_*)
+int sysv_shmget_flags(const ModeConfig *mc, int extra_flags) {
+    int flags = IPC_CREAT | IPC_EXCL | 0600;
+    if (mc->mode == MODE_2M) flags |= SHM_HUGETLB | SHM_HUGE_2MB;
+    if (mc->mode == MODE_1G) flags |= SHM_HUGETLB | SHM_HUGE_1GB;
+    if (extra_flags & MAP_NORESERVE) flags |= SHM_NORESERVE;
+    return flags;
+}
+
+// Create and attach a SysV segment. It is marked for removal right away, so
+// it disappears on the last detach even if the program is killed.
+void *attach_sysv_segment(size_t size, const ModeConfig *mc, int extra_flags, int *shmid) {
+    *shmid = shmget(IPC_PRIVATE, size, sysv_shmget_flags(mc, extra_flags));
+    if (*shmid < 0) return MAP_FAILED;
+    void *addr = shmat(*shmid, NULL, 0);
+    int err = errno;
+    shmctl(*shmid, IPC_RMID, NULL);
+    if (addr == (void *)-1) {
+        errno = err;
+        return MAP_FAILED;
+    }
+    return addr;
+}
+
+// Create a test mapping of size bytes. Returns MAP_FAILED (errno set) on failure.
+// *fd receives the descriptor backing the mapping (the shm id for sysv), or
+// -1 for anonymous memory. file describes the file for file-backed backings.
+void *map_region(size_t size, const ModeConfig *mc, Backing backing, int extra_flags,
+                 const FileOptions *file, int *fd) {
+    const char *path = file ? file->path : NULL;
+    int prot = PROT_READ | PROT_WRITE;
+    *fd = -1;
+    if (backing == BACKING_SYSV) {
+        return attach_sysv_segment(size, mc, extra_flags, fd);
+    }
+    if (backing == BACKING_FILE || backing == BACKING_TMPFS) {
+        if (!path) {
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+        *fd = open_data_file(file, size);
+        if (*fd < 0) return MAP_FAILED;
+        if (file->read_only) prot = PROT_READ;
+    }
+    if (backing == BACKING_TMPFS) {
+        struct statfs sfs;
+        if (fstatfs(*fd, &sfs) != 0 || sfs.f_type != TMPFS_MAGIC) {
+            fprintf(stderr, "Error: %s is not on a tmpfs mount.\n", path);
+            close(*fd);
+            *fd = -1;
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+    } else if (backing == BACKING_MEMFD) {
+        unsigned int mfd_flags = MFD_CLOEXEC;
+        if (mc->mode == MODE_2M) mfd_flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+        if (mc->mode == MODE_1G) mfd_flags |= MFD_HUGETLB | MFD_HUGE_1GB;
+        *fd = memfd_create("mmap_overhead", mfd_flags);
+        if (*fd < 0) return MAP_FAILED;
+        if (ftruncate(*fd, (off_t)size) != 0) {
+            int err = errno;
+            close(*fd);
+            *fd = -1;
+            errno = err;
+            return MAP_FAILED;
+        }
+    }
+    void *addr = mmap(NULL, size, prot, region_mmap_flags(mc, backing, extra_flags, file), *fd, 0);
+    if (addr == MAP_FAILED && *fd >= 0) {
+        int err = errno;
+        close(*fd);
+        *fd = -1;
+        errno = err;
+    }
+    return addr;
+}
+
+// Apply the mode's madvise hint (after a successful mmap). Shmem honors
+// MADV_HUGEPAGE under shmem_enabled=advise or a huge=advise tmpfs mount, and
+// khugepaged only collapses file mappings that have it, so the hint is
+// always given for shmem and file backings in thp mode.
+void advise_region(void *addr, size_t size, const ModeConfig *mc, Backing backing, ThpStatus thp_status) {
+    if (mc->mode == MODE_4K) {
+        if (madvise(addr, size, MADV_NOHUGEPAGE) == -1) {
             fprintf(stderr, "Warning: madvise(MADV_NOHUGEPAGE) failed: %s\n", strerror(errno));
         }
-    } else if (mode == MODE_THP && thp_status == THP_MADVISE) {
-        if (madvise(addr, map_size, MADV_HUGEPAGE) == -1) {
+    } else if (mc->mode == MODE_THP &&
+               (thp_status == THP_MADVISE || backing_is_shmem(backing) || backing == BACKING_FILE)) {
+        if (madvise(addr, size, MADV_HUGEPAGE) == -1) {
             fprintf(stderr, "Warning: madvise(MADV_HUGEPAGE) failed: %s\n", strerror(errno));
         }
     }
+}
 
-    // --- Touch the memory ---
-    printf("--- Touching Memory (1 byte per %zu KB page/stride) ---\n", touch_step_size / 1024);
-    volatile char *ptr = (volatile char *)addr;
-    size_t touched_count = 0;
-    for (size_t i = 0; i < map_size; i += touch_step_size) {
-        ptr[i] = (char)(i % 256);
-        touched_count++;
+void unmap_region(void *addr, size_t size, Backing backing, int fd) {
+    if (backing == BACKING_SYSV) {
+        if (shmdt(addr) == -1) perror("Error: shmdt failed");
+        return;
     }
-    printf("Touched %zu strides.\n", touched_count);
-
-    // --- Get VmPTE after mapping and touching ---
-    long vmpte_after = get_vmpte_kb();
-    if (vmpte_after < 0) {
-        fprintf(stderr, "Warning: Could not get final VmPTE. Change calculation skipped.\n");
-    } else {
-        printf("Final VmPTE:   %ld kB\n", vmpte_after);
-        long vmpte_diff = vmpte_after - vmpte_before;
-        printf("VmPTE Change:  %ld kB\n", vmpte_diff);
-        printf("--------------------------------------------------\n");
-        printf("NOTE: VmPTE reflects the *total* process page table size.\n");
-        printf("      The change observed is an *indicator*, not a precise measure\n");
-        printf("      of the overhead for *this specific mapping* alone.\n");
-        printf("      It can be influenced by THP, other allocations, etc.\n");
-        printf("--------------------------------------------------\n");
+    if (munmap(addr, size) == -1) {
+        perror("Error: munmap failed");
     }
+    if (fd >= 0) close(fd);
+}
 
-    // --- Calculate Theoretical Overheads ---
-    printf("\n--- Theoretical Overhead Calculation (Lowest Level Entries Only) ---\n");
-    size_t overhead_4k = calculate_overhead(map_size, PAGE_SIZE_4K);
-    printf("If using 4KB pages: %zu entries * %d bytes = %zu bytes (%.2f KB / %.2f MB)\n",
-           (map_size + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K, PTE_SIZE, overhead_4k,
-           (double)overhead_4k / 1024, (double)overhead_4k / (1024*1024));
+// System-wide SysV shared memory usage from shmctl(SHM_INFO), in pages
+int get_shm_info(struct shm_info *info) {
+    return shmctl(0, SHM_INFO, (struct shmid_ds *)(void *)info) < 0 ? -1 : 0;
+}
 
-    if (map_size >= PAGE_SIZE_2M) {
-        size_t overhead_2m = calculate_overhead(map_size, PAGE_SIZE_2M);
-        printf("If using 2MB pages: %zu entries * %d bytes = %zu bytes (%.2f KB / %.2f MB)\n",
-               (map_size + PAGE_SIZE_2M - 1) / PAGE_SIZE_2M, PTE_SIZE, overhead_2m,
-               (double)overhead_2m / 1024, (double)overhead_2m / (1024*1024));
-    } else {
-        printf("If using 2MB pages: N/A (mapping size < 2MB)\n");
-    }
+// --- HugeTLB Pool Preflight ---
 
-    if (map_size >= PAGE_SIZE_1G) {
-        size_t overhead_1g = calculate_overhead(map_size, PAGE_SIZE_1G);
-        printf("If using 1GB pages: %zu entries * %d bytes = %zu bytes (%.2f KB / %.2f MB)\n",
-               (map_size + PAGE_SIZE_1G - 1) / PAGE_SIZE_1G, PTE_SIZE, overhead_1g,
-               (double)overhead_1g / 1024, (double)overhead_1g / (1024*1024));
+// Monotonic clock in nanoseconds, used to time the cheap sysfs-only checks
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Counters of one HugeTLB pool (one page size), globally or for a single NUMA node.
+// All values are in huge pages; -1 means the counter is not available.
+typedef struct {
+    long long total;      // nr_hugepages
+    long long free;       // free_hugepages
+    long long resv;       // resv_hugepages (global pool only)
+    long long surplus;    // surplus_hugepages
+    long long overcommit; // nr_overcommit_hugepages (global pool only)
+} HugePoolCounts;
+
+// Build the sysfs directory of the pool for huge_page_size (node < 0: global pool)
+void hugepool_dir(size_t huge_page_size, int node, char *buf, size_t len) {
+    if (node < 0) {
+        snprintf(buf, len, "/sys/kernel/mm/hugepages/hugepages-%zukB", huge_page_size / 1024);
     } else {
-        printf("If using 1GB pages: N/A (mapping size < 1GB)\n");
+        snprintf(buf, len, "/sys/devices/system/node/node%d/hugepages/hugepages-%zukB",
+                 node, huge_page_size / 1024);
     }
-    printf("--------------------------------------------------\n");
-    printf("NOTE: These calculations show potential lowest-level entry overhead only.\n");
-    printf("      They don't include intermediate page directory costs.\n");
-    printf("      Actual overhead depends on kernel behavior (THP, etc.).\n");
-    printf("--------------------------------------------------\n");
+}
 
-    printf("PID: %d - You may inspect `/proc/%d/smaps` now, then press Enter...\n", getpid(), getpid());
-    getchar();
+// Read pool counters. Returns 0 on success, -1 if the kernel has no pool of this size.
+int read_hugepool_counts(size_t huge_page_size, int node, HugePoolCounts *c) {
+    char dir[PATH_MAX], path[PATH_MAX + 32];
+    hugepool_dir(huge_page_size, node, dir, sizeof(dir));
 
-    // --- Cleanup ---
-    printf("\n--- Unmapping Memory ---\n");
-    if (munmap(addr, map_size) == -1) {
-        // Report error on failure
-        perror("Error: munmap failed");
+    snprintf(path, sizeof(path), "%s/nr_hugepages", dir);
+    c->total = read_ll_file(path);
+    if (c->total < 0) return -1;
+    snprintf(path, sizeof(path), "%s/free_hugepages", dir);
+    c->free = read_ll_file(path);
+    snprintf(path, sizeof(path), "%s/resv_hugepages", dir);
+    c->resv = read_ll_file(path);
+    snprintf(path, sizeof(path), "%s/surplus_hugepages", dir);
+    c->surplus = read_ll_file(path);
+    snprintf(path, sizeof(path), "%s/nr_overcommit_hugepages", dir);
+    c->overcommit = read_ll_file(path);
+    return 0;
+}
+
+// Fill nodes[] with the online NUMA node ids. Returns the number of nodes found.
+int list_numa_nodes(int *nodes, int max_nodes) {
+    DIR *d = opendir("/sys/devices/system/node");
+    if (!d) return 0;
+    int count = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL && count < max_nodes) {
+        int id;
+        char extra;
+        if (sscanf(de->d_name, "node%d%c", &id, &extra) == 1) {
+            nodes[count++] = id;
+        }
+    }
+    closedir(d);
+    // readdir order is arbitrary; keep the output stable
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && nodes[j - 1] > nodes[j]; j--) {
+            int tmp = nodes[j]; nodes[j] = nodes[j - 1]; nodes[j - 1] = tmp;
+        }
     }
+    return count;
+}
+
+// Name the hugetlb cgroup controller uses for a page size ("2MB", "1GB", "64KB")
+void hugetlb_cgroup_size_name(size_t huge_page_size, char *buf, size_t len) {
+    if (huge_page_size >= PAGE_SIZE_1G) snprintf(buf, len, "%zuGB", huge_page_size / PAGE_SIZE_1G);
+    else if (huge_page_size >= 1024 * 1024) snprintf(buf, len, "%zuMB", huge_page_size / (1024 * 1024));
+    else snprintf(buf, len, "%zuKB", huge_page_size / 1024);
+}
+
+// Find the mount point of a cgroup hierarchy in /proc/mounts.
+// controller == NULL looks for the cgroup v2 (unified) hierarchy.
+int find_cgroup_mount(const char *controller, char *buf, size_t len) {
+    FILE *f = fopen("/proc/mounts", "r");
+    if (!f) return -1;
+    char dev[256], dir[PATH_MAX], type[64], opts[1024];
+    int found = -1;
+    while (fscanf(f, "%255s %4095s %63s %1023s %*d %*d", dev, dir, type, opts) == 4) {
+        if (controller == NULL && strcmp(type, "cgroup2") == 0) {
+            found = 0;
+        } else if (controller != NULL && strcmp(type, "cgroup") == 0) {
+            // Options are a comma separated list, match whole words only
+            char *save = NULL;
+            for (char *tok = strtok_r(opts, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                if (strcmp(tok, controller) == 0) { found = 0; break; }
+            }
+        }
+        if (found == 0) {
+            snprintf(buf, len, "%s", dir);
+            break;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// Find this process's cgroup path (relative to the hierarchy root) in /proc/self/cgroup.
+// controller == NULL selects the cgroup v2 entry ("0::/path").
+int get_own_cgroup(const char *controller, char *buf, size_t len) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) return -1;
+    char line[PATH_MAX + 256];
+    int found = -1;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *ctrls = strchr(line, ':');
+        if (!ctrls) continue;
+        ctrls++;
+        char *path = strchr(ctrls, ':');
+        if (!path) continue;
+        *path++ = '\0';
+        int match = 0;
+        if (controller == NULL) {
+            match = (ctrls[0] == '\0' && strncmp(line, "0:", 2) == 0);
+        } else {
+            char *save = NULL;
+            for (char *tok = strtok_r(ctrls, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                if (strcmp(tok, controller) == 0) { match = 1; break; }
+            }
+        }
+        if (match) {
+            snprintf(buf, len, "%s", path);
+            found = 0;
+            break;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// Read a cgroup limit file: "max" (v2) or a huge v1 value means unlimited (returns LLONG_MAX).
+long long read_cgroup_limit(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char buf[64] = "";
+    long long val = -1;
+    if (fgets(buf, sizeof(buf), f)) {
+        if (strncmp(buf, "max", 3) == 0) val = LLONG_MAX;
+        else if (sscanf(buf, "%lld", &val) != 1) val = -1;
+    }
+    fclose(f);
+    // cgroup v1 reports "unlimited" as a page-rounded LLONG_MAX
+    if (val >= LLONG_MAX / 2) val = LLONG_MAX;
+    return val;
+}
+
+// Tightest hugetlb cgroup restriction on this process for one page size
+typedef struct {
+    long long headroom;       // Bytes still chargeable (LLONG_MAX: unlimited, -1: unknown)
+    long long limit;          // Limit of the restricting cgroup
+    long long usage;          // Usage of the restricting cgroup
+    int reservation;          // Restriction comes from a hugetlb.<size>.rsvd.max limit
+    char where[PATH_MAX];     // Cgroup directory holding the restriction
+} HugetlbCgroupLimit;
+
+// Check one limit/usage file pair and keep it if it is tighter than what we have
+void hugetlb_cgroup_check(const char *dir, const char *limit_file, const char *usage_file,
+                          int reservation, HugetlbCgroupLimit *out) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, limit_file);
+    long long limit = read_cgroup_limit(path);
+    if (limit < 0) return;
+    if (out->headroom < 0) out->headroom = LLONG_MAX; // Controller is present
+    if (limit == LLONG_MAX) return;
+    snprintf(path, sizeof(path), "%s/%s", dir, usage_file);
+    long long usage = read_ll_file(path);
+    if (usage < 0) usage = 0;
+    long long headroom = limit > usage ? limit - usage : 0;
+    if (headroom < out->headroom) {
+        out->headroom = headroom;
+        out->limit = limit;
+        out->usage = usage;
+        out->reservation = reservation;
+        snprintf(out->where, sizeof(out->where), "%s", dir);
+    }
+}
+
+// Walk from this process's cgroup up to the hierarchy root (v2 first, then v1)
+// and find the smallest remaining hugetlb headroom. The limit is hierarchical,
+// so any ancestor can be the one that stops us.
+void get_hugetlb_cgroup_limit(size_t huge_page_size, HugetlbCgroupLimit *out) {
+    memset(out, 0, sizeof(*out));
+    out->headroom = -1;
+
+    char size_name[16];
+    hugetlb_cgroup_size_name(huge_page_size, size_name, sizeof(size_name));
+
+    for (int v1 = 0; v1 <= 1; v1++) {
+        char mount[PATH_MAX], cg[PATH_MAX];
+        const char *controller = v1 ? "hugetlb" : NULL;
+        if (find_cgroup_mount(controller, mount, sizeof(mount)) != 0) continue;
+        if (get_own_cgroup(controller, cg, sizeof(cg)) != 0) continue;
+
+        char dir[2 * PATH_MAX];
+        char limit_file[64], usage_file[64], rsvd_limit[64], rsvd_usage[64];
+        if (v1) {
+            snprintf(limit_file, sizeof(limit_file), "hugetlb.%s.limit_in_bytes", size_name);
+            snprintf(usage_file, sizeof(usage_file), "hugetlb.%s.usage_in_bytes", size_name);
+            snprintf(rsvd_limit, sizeof(rsvd_limit), "hugetlb.%s.rsvd.limit_in_bytes", size_name);
+            snprintf(rsvd_usage, sizeof(rsvd_usage), "hugetlb.%s.rsvd.usage_in_bytes", size_name);
+        } else {
+            snprintf(limit_file, sizeof(limit_file), "hugetlb.%s.max", size_name);
+            snprintf(usage_file, sizeof(usage_file), "hugetlb.%s.current", size_name);
+            snprintf(rsvd_limit, sizeof(rsvd_limit), "hugetlb.%s.rsvd.max", size_name);
+            snprintf(rsvd_usage, sizeof(rsvd_usage), "hugetlb.%s.rsvd.current", size_name);
+        }
+
+        // Strip path components one by one until we reach the root cgroup
+        for (;;) {
+            snprintf(dir, sizeof(dir), "%s%s", mount, strcmp(cg, "/") == 0 ? "" : cg);
+            hugetlb_cgroup_check(dir, limit_file, usage_file, 0, out);
+            hugetlb_cgroup_check(dir, rsvd_limit, rsvd_usage, 1, out);
+            char *slash = strrchr(cg, '/');
+            if (!slash || slash == cg) {
+                if (strcmp(cg, "/") == 0) break;
+                strcpy(cg, "/");
+            } else {
+                *slash = '\0';
+            }
+        }
+    }
+}
+
+// --- HugeTLB Pool Provisioning ---
+
+// Original pool size to restore when --provision changed it
+typedef struct {
+    volatile sig_atomic_t active;
+    char path[PATH_MAX + 32];
+    long long original;
+    char original_str[32]; // Formatted when armed; the signal handler can't use snprintf
+} PoolRollback;
+
+PoolRollback pool_rollback;
+
+// Only async-signal-safe calls: open/write/close in write_str_file, then _exit
+void restore_hugepool_on_signal(int sig) {
+    if (pool_rollback.active) {
+        write_str_file(pool_rollback.path, pool_rollback.original_str);
+        pool_rollback.active = 0;
+    }
+    _exit(128 + sig);
+}
+
+// In a forked child: leave the rollback to the parent, so a child killed by a
+// signal does not shrink the pool under the still-running parent
+void disarm_hugepool_rollback() {
+    pool_rollback.active = 0;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+}
+
+// Put nr_hugepages back to the value found before provisioning (atexit handler)
+void restore_hugepool() {
+    if (!pool_rollback.active) return;
+    pool_rollback.active = 0;
+    uint64_t start = now_ns();
+    if (write_ll_file(pool_rollback.path, pool_rollback.original) != 0) {
+        fprintf(stderr, "Warning: Could not restore %s to %lld: %s\n",
+                pool_rollback.path, pool_rollback.original, strerror(errno));
+        return;
+    }
+    printf("\n--- HugeTLB Pool Rollback ---\n");
+    printf("Restored %s to %lld (took %.2f ms)\n", pool_rollback.path, pool_rollback.original,
+           (double)(now_ns() - start) / 1e6);
+}
+
+// Grow the pool (globally, or on one NUMA node if node >= 0) so that map_size
+// can be reserved, timing how long the kernel takes to assemble the pages.
+// The original size is restored at exit. Returns 0 on success.
+int provision_hugepool(size_t map_size, size_t huge_page_size, int node) {
+    if (node >= 0) printf("--- HugeTLB Pool Provisioning (node %d) ---\n", node);
+    else printf("--- HugeTLB Pool Provisioning ---\n");
+
+    HugePoolCounts global, target_pool;
+    if (read_hugepool_counts(huge_page_size, -1, &global) != 0 ||
+        read_hugepool_counts(huge_page_size, node, &target_pool) != 0) {
+        fprintf(stderr, "Error: No %zu kB HugeTLB pool%s to provision.\n", huge_page_size / 1024,
+                node >= 0 ? " on this node" : "");
+        return -1;
+    }
+
+    long long needed = (long long)((map_size + huge_page_size - 1) / huge_page_size);
+    long long unreserved = global.free - (global.resv > 0 ? global.resv : 0);
+    if (unreserved < 0) unreserved = 0;
+    long long missing = needed - unreserved;
+    if (missing <= 0) {
+        printf("Pool already has %lld unreserved pages for %lld requested; nothing to provision.\n",
+               unreserved, needed);
+        printf("--------------------------------------------------\n");
+        return 0;
+    }
+
+    char dir[PATH_MAX];
+    hugepool_dir(huge_page_size, node, dir, sizeof(dir));
+    snprintf(pool_rollback.path, sizeof(pool_rollback.path), "%s/nr_hugepages", dir);
+    pool_rollback.original = target_pool.total;
+    snprintf(pool_rollback.original_str, sizeof(pool_rollback.original_str), "%lld\n", pool_rollback.original);
+    long long target = target_pool.total + missing;
+
+    // Register the rollback before touching the pool so an interrupted run still restores it
+    static int handlers_installed = 0;
+    if (!handlers_installed) {
+        atexit(restore_hugepool);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = restore_hugepool_on_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGHUP, &sa, NULL);
+        handlers_installed = 1;
+    }
+
+    printf("Requesting:   nr_hugepages %lld -> %lld (+%lld pages)\n", target_pool.total, target, missing);
+    pool_rollback.active = 1;
+    uint64_t start = now_ns();
+    // The write returns once the kernel has allocated (or given up on) the pages
+    if (write_ll_file(pool_rollback.path, target) != 0) {
+        int err = errno;
+        pool_rollback.active = 0;
+        fprintf(stderr, "Error: Could not write %s: %s\n", pool_rollback.path, strerror(err));
+        if (err == EACCES || err == EPERM) {
+            fprintf(stderr, "  Hint: Provisioning requires root.\n");
+        }
+        return -1;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    HugePoolCounts after;
+    if (read_hugepool_counts(huge_page_size, node, &after) != 0) after.total = target_pool.total;
+    long long obtained = after.total - target_pool.total;
+    double secs = (double)elapsed / 1e9;
+    printf("Obtained:     %lld of %lld pages (%.1f%%) in %.2f ms",
+           obtained, missing, 100.0 * (double)obtained / (double)missing, secs * 1e3);
+    if (obtained > 0 && secs > 0) {
+        printf(" (%.0f pages/s, %.2f GB/s)", (double)obtained / secs,
+               (double)obtained * huge_page_size / PAGE_SIZE_1G / secs);
+    }
+    printf("\n");
+    if (obtained < missing) {
+        printf("Shortfall:    %lld pages could not be assembled (free memory or fragmentation)\n",
+               missing - obtained);
+    }
+    printf("Original value (%lld) will be restored at exit.\n", pool_rollback.original);
+    printf("--------------------------------------------------\n");
+    return 0;
+}
+
+// Outcome of the preflight, also used as the --preflight exit status
+typedef enum {
+    PREFLIGHT_OK = 0,       // Enough free, unreserved pages in the pool
+    PREFLIGHT_ERROR = 1,    // Pool size not supported / counters unreadable
+    PREFLIGHT_MAYBE = 2,    // Only possible with surplus pages (nr_overcommit_hugepages)
+    PREFLIGHT_FAIL = 3      // Will fail with ENOMEM (or SIGBUS at fault for cgroup limits)
+} PreflightResult;
+
+// Print the pool state for the requested size and predict whether a
+// MAP_HUGETLB mapping of map_size will succeed. Only reads sysfs/cgroupfs.
+PreflightResult hugetlb_preflight(size_t map_size, size_t huge_page_size) {
+    uint64_t start = now_ns();
+    printf("--- HugeTLB Preflight (%zu kB pages) ---\n", huge_page_size / 1024);
+
+    HugePoolCounts pool;
+    if (read_hugepool_counts(huge_page_size, -1, &pool) != 0) {
+        char dir[PATH_MAX];
+        hugepool_dir(huge_page_size, -1, dir, sizeof(dir));
+        printf("Pool:       not available (%s missing)\n", dir);
+        printf("Verdict:    WILL FAIL - kernel does not support %zu kB HugeTLB pages\n", huge_page_size / 1024);
+        printf("--------------------------------------------------\n");
+        return PREFLIGHT_ERROR;
+    }
+
+    long long needed = (long long)((map_size + huge_page_size - 1) / huge_page_size);
+    long long unreserved = pool.free - (pool.resv > 0 ? pool.resv : 0);
+    if (unreserved < 0) unreserved = 0;
+    long long overcommit_room = 0;
+    if (pool.overcommit > 0) {
+        overcommit_room = pool.overcommit - (pool.surplus > 0 ? pool.surplus : 0);
+        if (overcommit_room < 0) overcommit_room = 0;
+    }
+
+    printf("Pool:       total %lld, free %lld, reserved %lld, surplus %lld, overcommit %lld\n",
+           pool.total, pool.free, pool.resv, pool.surplus, pool.overcommit);
+
+    int nodes[256];
+    int node_count = list_numa_nodes(nodes, 256);
+    for (int i = 0; i < node_count; i++) {
+        HugePoolCounts nc;
+        if (read_hugepool_counts(huge_page_size, nodes[i], &nc) != 0) continue;
+        printf("  Node %-3d  total %lld, free %lld, surplus %lld\n", nodes[i], nc.total, nc.free, nc.surplus);
+    }
+
+    HugetlbCgroupLimit cg;
+    get_hugetlb_cgroup_limit(huge_page_size, &cg);
+    long long cg_pages = LLONG_MAX;
+    if (cg.headroom < 0) {
+        printf("Cgroup:     hugetlb controller not found\n");
+    } else if (cg.headroom == LLONG_MAX) {
+        printf("Cgroup:     no hugetlb limit\n");
+    } else {
+        cg_pages = cg.headroom / (long long)huge_page_size;
+        printf("Cgroup:     %s limit %lld bytes, usage %lld bytes -> room for %lld pages (%s)\n",
+               cg.reservation ? "reservation" : "fault", cg.limit, cg.usage, cg_pages, cg.where);
+    }
+
+    long long guaranteed = unreserved < cg_pages ? unreserved : cg_pages;
+    long long possible = unreserved + overcommit_room;
+    if (possible > cg_pages) possible = cg_pages;
+
+    printf("Requested:  %lld pages (%zu bytes)\n", needed, map_size);
+    printf("Largest satisfiable: %lld pages = %llu bytes (%.2f GB)",
+           guaranteed, (unsigned long long)guaranteed * huge_page_size,
+           (double)guaranteed * huge_page_size / PAGE_SIZE_1G);
+    if (possible > guaranteed) {
+        printf(", up to %lld pages with surplus allocation", possible);
+    }
+    printf("\n");
+
+    PreflightResult result;
+    if (needed <= guaranteed) {
+        printf("Verdict:    WILL SUCCEED - enough free, unreserved pages\n");
+        result = PREFLIGHT_OK;
+    } else if (needed <= possible) {
+        printf("Verdict:    MAY SUCCEED - needs %lld surplus pages from the buddy allocator\n",
+               needed - unreserved);
+        printf("            (depends on free contiguous memory)\n");
+        result = PREFLIGHT_MAYBE;
+    } else {
+        if (needed > unreserved + overcommit_room) {
+            printf("Verdict:    WILL FAIL - pool is short by %lld pages (mmap returns ENOMEM)\n",
+                   needed - unreserved - overcommit_room);
+        } else if (cg.reservation) {
+            printf("Verdict:    WILL FAIL - hugetlb cgroup reservation limit (mmap returns ENOMEM)\n");
+        } else {
+            printf("Verdict:    WILL FAIL - hugetlb cgroup limit (SIGBUS at fault time)\n");
+        }
+        result = PREFLIGHT_FAIL;
+    }
+    if (node_count > 1) {
+        printf("NOTE: Reservations are global; with a NUMA memory policy only the\n");
+        printf("      free pages of the allowed nodes count.\n");
+    }
+    printf("Preflight took %.1f us\n", (double)(now_ns() - start) / 1000.0);
+    printf("--------------------------------------------------\n");
+    return result;
+}
+
+// --- cgroup v2 Scoped Runs ---
+
+// Per-run child cgroup created under a delegated cgroup v2 subtree
+typedef struct {
+    char dir[PATH_MAX];
+    int has_memory;   // memory controller enabled for the child
+    int has_hugetlb;  // hugetlb controller enabled for the child
+} CgroupRun;
+
+// Memory counters of the run cgroup, in bytes (-1: not available)
+typedef struct {
+    long long pagetables;
+    long long anon;
+    long long anon_thp;
+    long long file_thp;
+    long long shmem_thp;
+    long long hugetlb;    // hugetlb.<size>.current for the mode's page size
+} CgroupMemSnapshot;
+
+// Read "key value" from a flat keyed cgroup file (memory.stat, memory.events)
+long long read_cgroup_keyed(const char *dir, const char *file, const char *key) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    size_t key_len = strlen(key);
+    long long val = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ' ') {
+            if (sscanf(line + key_len + 1, "%lld", &val) != 1) val = -1;
+            break;
+        }
+    }
+    fclose(f);
+    return val;
+}
+
+// Check whether a controller is listed in a space separated controller file
+int cgroup_has_controller(const char *dir, const char *file, const char *controller) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    char word[64];
+    int found = 0;
+    while (fscanf(f, "%63s", word) == 1) {
+        if (strcmp(word, controller) == 0) { found = 1; break; }
+    }
+    fclose(f);
+    return found;
+}
+
+// Enable a controller for the children of parent. Returns 1 if it is available to them.
+int cgroup_enable_controller(const char *parent, const char *controller) {
+    if (cgroup_has_controller(parent, "cgroup.subtree_control", controller)) return 1;
+    if (!cgroup_has_controller(parent, "cgroup.controllers", controller)) {
+        printf("Warning: '%s' controller is not delegated to %s\n", controller, parent);
+        return 0;
+    }
+    char path[PATH_MAX + 64], cmd[64];
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", parent);
+    snprintf(cmd, sizeof(cmd), "+%s", controller);
+    if (write_str_file(path, cmd) != 0) {
+        printf("Warning: Could not enable '%s' in %s: %s\n", controller, path, strerror(errno));
+        if (errno == EBUSY) {
+            printf("  Hint: cgroup v2 cannot enable controllers for a cgroup that has processes\n");
+            printf("        of its own; use an empty (leaf-free) delegated subtree.\n");
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// Create <parent>/mmap_overhead.<pid> with the memory and hugetlb controllers
+// and an optional memory.max. Returns 0 on success.
+int cgroup_run_setup(const char *parent, size_t memory_max, CgroupRun *cg) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", parent);
+    if (access(path, F_OK) != 0) {
+        fprintf(stderr, "Error: %s is not a cgroup v2 directory.\n", parent);
+        return -1;
+    }
+
+    cg->has_memory = cgroup_enable_controller(parent, "memory");
+    cg->has_hugetlb = cgroup_enable_controller(parent, "hugetlb");
+
+    snprintf(cg->dir, sizeof(cg->dir), "%s/mmap_overhead.%d", parent, getpid());
+    if (mkdir(cg->dir, 0755) != 0) {
+        fprintf(stderr, "Error: Could not create cgroup %s: %s\n", cg->dir, strerror(errno));
+        return -1;
+    }
+
+    if (memory_max > 0) {
+        snprintf(path, sizeof(path), "%s/memory.max", cg->dir);
+        if (!cg->has_memory || write_ll_file(path, (long long)memory_max) != 0) {
+            fprintf(stderr, "Error: Could not set %s: %s\n", path,
+                    cg->has_memory ? strerror(errno) : "memory controller not available");
+            rmdir(cg->dir);
+            return -1;
+        }
+    }
+    printf("Cgroup:     %s (memory %s, hugetlb %s", cg->dir,
+           cg->has_memory ? "on" : "off", cg->has_hugetlb ? "on" : "off");
+    if (memory_max > 0) printf(", memory.max %zu bytes", memory_max);
+    printf(")\n");
+    return 0;
+}
+
+// Move the calling process into the run cgroup
+int cgroup_run_join(const CgroupRun *cg) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", cg->dir);
+    if (write_str_file(path, "0") != 0) {
+        fprintf(stderr, "Error: Could not join %s: %s\n", cg->dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void cgroup_mem_snapshot(const CgroupRun *cg, size_t huge_page_size, CgroupMemSnapshot *snap) {
+    snap->pagetables = read_cgroup_keyed(cg->dir, "memory.stat", "pagetables");
+    snap->anon = read_cgroup_keyed(cg->dir, "memory.stat", "anon");
+    snap->anon_thp = read_cgroup_keyed(cg->dir, "memory.stat", "anon_thp");
+    snap->file_thp = read_cgroup_keyed(cg->dir, "memory.stat", "file_thp");
+    snap->shmem_thp = read_cgroup_keyed(cg->dir, "memory.stat", "shmem_thp");
+    snap->hugetlb = -1;
+    if (huge_page_size > 0) {
+        char size_name[16], path[PATH_MAX + 64];
+        hugetlb_cgroup_size_name(huge_page_size, size_name, sizeof(size_name));
+        snprintf(path, sizeof(path), "%s/hugetlb.%s.current", cg->dir, size_name);
+        snap->hugetlb = read_ll_file(path);
+    }
+}
+
+void print_cgroup_counter(const char *name, long long before, long long after) {
+    if (before < 0 || after < 0) {
+        printf("  %-20s n/a\n", name);
+        return;
+    }
+    printf("  %-20s %10lld kB -> %10lld kB (change %+lld kB)\n",
+           name, before / 1024, after / 1024, (after - before) / 1024);
+}
+
+void print_cgroup_mem_delta(const CgroupRun *cg, size_t huge_page_size,
+                            const CgroupMemSnapshot *before, const CgroupMemSnapshot *after) {
+    printf("--- Cgroup Accounting (%s) ---\n", cg->dir);
+    print_cgroup_counter("pagetables", before->pagetables, after->pagetables);
+    print_cgroup_counter("anon", before->anon, after->anon);
+    print_cgroup_counter("anon_thp", before->anon_thp, after->anon_thp);
+    print_cgroup_counter("file_thp", before->file_thp, after->file_thp);
+    print_cgroup_counter("shmem_thp", before->shmem_thp, after->shmem_thp);
+    if (huge_page_size > 0) {
+        char size_name[16], label[48];
+        hugetlb_cgroup_size_name(huge_page_size, size_name, sizeof(size_name));
+        snprintf(label, sizeof(label), "hugetlb.%s.current", size_name);
+        print_cgroup_counter(label, before->hugetlb, after->hugetlb);
+    }
+    printf("NOTE: memory.stat only covers the processes of this run's cgroup,\n");
+    printf("      so 'pagetables' is not mixed up with other tasks on the host.\n");
+    printf("--------------------------------------------------\n");
+}
+
+// Wait for the measurement child, report how it ended and remove the run cgroup.
+// Returns the exit status to use for the parent.
+int cgroup_run_finish(const CgroupRun *cg, pid_t child) {
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {}
+
+    long long oom = read_cgroup_keyed(cg->dir, "memory.events", "oom");
+    long long oom_kill = read_cgroup_keyed(cg->dir, "memory.events", "oom_kill");
+    long long max_hits = read_cgroup_keyed(cg->dir, "memory.events", "max");
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/memory.peak", cg->dir);
+    long long peak = read_ll_file(path);
+
+    int rc;
+    printf("\n--- Cgroup Run Summary ---\n");
+    if (WIFSIGNALED(status)) {
+        printf("Measurement child killed by signal %d (%s)\n", WTERMSIG(status), strsignal(WTERMSIG(status)));
+        rc = 128 + WTERMSIG(status);
+    } else {
+        rc = WEXITSTATUS(status);
+        printf("Measurement child exited with status %d\n", rc);
+    }
+    if (peak >= 0) printf("memory.peak:   %lld kB\n", peak / 1024);
+    if (max_hits >= 0) printf("memory.events: max %lld, oom %lld, oom_kill %lld\n", max_hits, oom, oom_kill);
+
+    // The cgroup can stay populated for a moment after the child is reaped
+    for (int attempt = 0; attempt < 100; attempt++) {
+        if (rmdir(cg->dir) == 0 || errno != EBUSY) break;
+        usleep(10000);
+    }
+    printf("--------------------------------------------------\n");
+    return rc;
+}
+
+// --- Touch Loop and HugeTLB Accounting ---
+
+__thread sigjmp_buf touch_fault_jmp; // Per thread: SIGBUS is delivered to the faulting thread
+
+void touch_fault_handler(int sig) {
+    (void)sig;
+    siglongjmp(touch_fault_jmp, 1);
+}
+
+// How the touch loop accesses each stride
+typedef enum {
+    TOUCH_WRITE,   // Store a pattern byte (anonymous memory)
+    TOUCH_REWRITE, // Store the byte that is already there (keeps file contents intact)
+    TOUCH_READ     // Load only (read-only mappings)
+} TouchAccess;
+
+// Install the SIGBUS handler of the touch loop; the previous one goes to *old.
+// The disposition is process-wide, so multi-threaded callers install it once
+// around all threads and use touch_memory_armed().
+void arm_touch_fault_handler(struct sigaction *old) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = touch_fault_handler;
+    sigaction(SIGBUS, &sa, old);
+}
+
+// Access one byte per stride, with the SIGBUS handler already installed. A
+// SIGBUS (HugeTLB pool or cgroup limit exhausted at fault time, or a file
+// shorter than the mapping) stops the loop instead of killing the process;
+// *fault_offset is then set to the offset that faulted, otherwise to SIZE_MAX.
+size_t touch_memory_armed(void *addr, size_t size, size_t step, TouchAccess access, size_t *fault_offset) {
+    volatile char *ptr = (volatile char *)addr;
+    volatile size_t i = 0;
+    *fault_offset = SIZE_MAX;
+    if (sigsetjmp(touch_fault_jmp, 1) == 0) {
+        for (i = 0; i < size; i += step) {
+            if (access == TOUCH_WRITE) ptr[i] = (char)(i % 256);
+            else if (access == TOUCH_REWRITE) ptr[i] = ptr[i];
+            else (void)ptr[i];
+        }
+    } else {
+        *fault_offset = i;
+    }
+    return (i + step - 1) / step;
+}
+
+// touch_memory_armed() for single-threaded callers: installs the handler for
+// the duration of the loop
+size_t touch_memory(void *addr, size_t size, size_t step, TouchAccess access, size_t *fault_offset) {
+    struct sigaction old_sa;
+    arm_touch_fault_handler(&old_sa);
+    size_t touched = touch_memory_armed(addr, size, step, access, fault_offset);
+    sigaction(SIGBUS, &old_sa, NULL);
+    return touched;
+}
+
+// Print the pool counters relevant to reservation vs. fault accounting,
+// with the change relative to the snapshot taken before mmap
+void print_hugepool_snapshot(const char *label, size_t huge_page_size, const HugePoolCounts *base) {
+    HugePoolCounts c;
+    if (read_hugepool_counts(huge_page_size, -1, &c) != 0) return;
+    printf("  %-15s HugePages_Free %6lld (%+lld), HugePages_Rsvd %6lld (%+lld), HugePages_Surp %6lld (%+lld)\n",
+           label, c.free, c.free - base->free, c.resv, c.resv - base->resv,
+           c.surplus, c.surplus - base->surplus);
+}
+
+// --- Benchmarks ---
+
+// Order in which a scenario visits the pages it accesses (--pattern)
+typedef enum {
+    PATTERN_SEQ,    // Ascending offsets
+    PATTERN_RANDOM  // Shuffled
+} AccessPattern;
+
+// Parameters shared by the --bench scenarios
+typedef struct {
+    size_t size;            // <size> argument
+    ModeConfig mode;        // <mode> argument
+    Backing backing;        // --backing
+    int extra_flags;        // MAP_NORESERVE from --noreserve
+    ThpStatus thp_status;
+    int procs;              // --procs: maximum number of processes
+    double touch_fraction;  // --touch-fraction: share of pages each process touches
+    FileOptions file;       // --file and friends, for file-backed scenarios
+    AccessPattern pattern;  // --pattern
+    long long fault_around_bytes; // --fault-around-bytes, -1 keeps the system setting
+    int threads;            // --threads: maximum number of I/O threads (queue depth)
+    size_t block_size;      // --block-size: bytes per I/O request (or per ring record)
+    int rings;              // --rings: maximum number of ring buffers
+    size_t guard_size;      // --guard: PROT_NONE guard below each thread stack
+    size_t touch_depth;     // --touch-depth: bytes of each thread stack used
+    long mappings;          // --mappings: number of separate mappings (0: up to vm.max_map_count)
+    int guards;             // --guards: PROT_NONE guard after each mapping
+    int steps;              // --steps: growth steps
+    long moves;             // --moves: page relocations
+} BenchConfig;
+
+// What a measurement child reports back to the parent through a pipe
+typedef struct {
+    long vmpte_kb;
+    uint64_t touch_ns;
+    size_t touched;
+} ChildReport;
+
+// Touch a random subset (fraction) of the pages of a mapping, seeded per process
+size_t touch_fraction(void *addr, size_t size, size_t step, double fraction, unsigned int seed) {
+    volatile char *ptr = (volatile char *)addr;
+    size_t touched = 0;
+    for (size_t i = 0; i < size; i += step) {
+        if (fraction < 1.0 && (double)rand_r(&seed) / RAND_MAX >= fraction) continue;
+        ptr[i] = (char)(i % 256);
+        touched++;
+    }
+    return touched;
+}
+
+// Fork nprocs children that each touch cfg->touch_fraction of the shared mapping
+// and stay alive until all of them reported, so their page tables coexist.
+// Fills reports[] and returns the system-wide PageTables growth in kB (-1 on error).
+long run_sharing_round(const BenchConfig *cfg, void *addr, size_t size, int nprocs, ChildReport *reports) {
+    int report_pipe[2], release_pipe[2];
+    if (pipe(report_pipe) != 0 || pipe(release_pipe) != 0) {
+        perror("Error: pipe failed");
+        return -1;
+    }
+    fflush(stdout);
+
+    long pagetables_before = get_settled_pagetables_kb();
+    int started = 0;
+    for (; started < nprocs; started++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Error: fork failed");
+            break;
+        }
+        if (pid == 0) {
+            disarm_hugepool_rollback();
+            close(report_pipe[0]);
+            close(release_pipe[1]);
+            ChildReport r;
+            uint64_t start = now_ns();
+            r.touched = touch_fraction(addr, size, cfg->mode.touch_step_size, cfg->touch_fraction,
+                                       (unsigned int)(nprocs * 1000 + started + 1));
+            r.touch_ns = now_ns() - start;
+            r.vmpte_kb = get_vmpte_kb();
+            if (write(report_pipe[1], &r, sizeof(r)) != (ssize_t)sizeof(r)) _exit(1);
+            // Hold the page tables until the parent has taken its reading
+            char c;
+            while (read(release_pipe[0], &c, 1) < 0 && errno == EINTR) {}
+            _exit(0);
+        }
+    }
+    close(report_pipe[1]);
+    close(release_pipe[0]);
+
+    int received = 0;
+    while (received < started) {
+        ssize_t n = read(report_pipe[0], &reports[received], sizeof(ChildReport));
+        if (n == (ssize_t)sizeof(ChildReport)) received++;
+        else if (n < 0 && errno == EINTR) continue;
+        else break; // A child died before reporting
+    }
+    long pagetables_after = get_pagetables_kb();
+
+    close(release_pipe[1]); // EOF releases all children
+    close(report_pipe[0]);
+    while (wait(NULL) > 0 || errno == EINTR) {}
+
+    if (received != nprocs || pagetables_before < 0 || pagetables_after < 0) {
+        fprintf(stderr, "Error: Only %d of %d processes reported.\n", received, nprocs);
+        return -1;
+    }
+    return pagetables_after - pagetables_before;
+}
+
+// Next process count of a scaling series: 1, 2, 4, ... and finally max
+int next_proc_count(int n, int max) {
+    if (n >= max) return 0;
+    return n * 2 < max ? n * 2 : max;
+}
+
+// One shared buffer pool mapped by a growing number of processes, each
+// building its own page tables for it (PostgreSQL-style shared_buffers)
+int bench_shared_pool(const BenchConfig *cfg) {
+    Backing backing = cfg->backing;
+    if (backing == BACKING_PRIVATE) {
+        backing = BACKING_SHARED; // Processes can only share a MAP_SHARED region
+    }
+    printf("--- Shared Buffer Pool Benchmark ---\n");
+    printf("Pool: %zu MB, %s backing, mode %s; each process touches %.0f%% of it\n",
+           cfg->size / (1024 * 1024), backing_name(backing), cfg->mode.name, cfg->touch_fraction * 100);
+
+    int fd;
+    void *addr = map_region(cfg->size, &cfg->mode, backing, cfg->extra_flags, &cfg->file, &fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+        return 1;
+    }
+    advise_region(addr, cfg->size, &cfg->mode, backing, cfg->thp_status);
+
+    // Populate the pool once so the children only build page tables and don't
+    // allocate memory. Shared mappings are not copied on fork, so every child
+    // starts with no page tables for the pool, like a freshly started backend.
+    size_t fault_offset;
+    touch_memory(addr, cfg->size, cfg->mode.touch_step_size, TOUCH_WRITE, &fault_offset);
+    if (fault_offset != SIZE_MAX) {
+        fprintf(stderr, "Error: SIGBUS while populating the pool at offset %zu.\n", fault_offset);
+        unmap_region(addr, cfg->size, backing, fd);
+        return 1;
+    }
+
+    size_t entry_size = cfg->mode.huge_page_size ? cfg->mode.huge_page_size : PAGE_SIZE_4K;
+    size_t touched_bytes = (size_t)(cfg->size * cfg->touch_fraction);
+    size_t theoretical = calculate_overhead(touched_bytes, entry_size);
+
+    ChildReport *reports = calloc((size_t)cfg->procs, sizeof(ChildReport));
+    if (!reports) {
+        unmap_region(addr, cfg->size, backing, fd);
+        return 1;
+    }
+    // Each forked process also copies the parent's private page tables. Measure
+    // that with processes that touch nothing, so only the pool's share remains.
+    BenchConfig idle = *cfg;
+    idle.touch_fraction = 0;
+    char dummy;
+    long base = run_sharing_round(&idle, &dummy, 0, cfg->procs, reports);
+    if (base < 0) {
+        free(reports);
+        unmap_region(addr, cfg->size, backing, fd);
+        return 1;
+    }
+    double base_per_proc = (double)base / cfg->procs;
+    printf("Base cost of a forked process (no pool access): %.1f kB\n", base_per_proc);
+
+    printf("%6s %16s %14s %14s %14s %16s %12s\n", "Procs", "PageTables(kB)", "Per-proc(kB)",
+           "Pool/proc(kB)", "VmPTE avg(kB)", "Theoretical(kB)", "Touch avg(ms)");
+    int rc = 0;
+    for (int n = 1; n > 0; n = next_proc_count(n, cfg->procs)) {
+        long total = run_sharing_round(cfg, addr, cfg->size, n, reports);
+        if (total < 0) { rc = 1; break; }
+        double vmpte_sum = 0, touch_sum = 0;
+        for (int i = 0; i < n; i++) {
+            vmpte_sum += (double)reports[i].vmpte_kb;
+            touch_sum += (double)reports[i].touch_ns;
+        }
+        printf("%6d %16ld %14.1f %14.1f %14.1f %16.1f %12.2f\n", n, total, (double)total / n,
+               (double)total / n - base_per_proc, vmpte_sum / n, (double)theoretical * n / 1024,
+               touch_sum / n / 1e6);
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: PageTables is the system-wide growth while all processes are alive;\n");
+    printf("      Pool/proc = Per-proc minus the base cost of a forked process.\n");
+    printf("      VmPTE also counts each process's own (non-pool) page tables.\n");
+    printf("      Theoretical = processes x lowest-level entries for the touched share.\n");
+    printf("--------------------------------------------------\n");
+
+    free(reports);
+    unmap_region(addr, cfg->size, backing, fd);
+    return rc;
+}
+
+// Map fd at an address that is 'shift' bytes past a PUD (1GB) boundary.
+// *reserve/*reserve_len receive the surrounding reservation to munmap later.
+void *map_at_pud_offset(int fd, size_t size, size_t shift, void **reserve, size_t *reserve_len) {
+    *reserve_len = size + PAGE_SIZE_1G + shift;
+    *reserve = mmap(NULL, *reserve_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (*reserve == MAP_FAILED) return MAP_FAILED;
+    uintptr_t aligned = ((uintptr_t)*reserve + PAGE_SIZE_1G - 1) & ~(uintptr_t)(PAGE_SIZE_1G - 1);
+    void *addr = mmap((void *)(aligned + shift), size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, fd, 0);
+    if (addr == MAP_FAILED) {
+        int err = errno;
+        munmap(*reserve, *reserve_len);
+        errno = err;
+    }
+    return addr;
+}
+
+// hugetlb PMD sharing: processes mapping the same hugetlb file at the same
+// PUD-aligned offsets share the PMD page-table pages instead of each
+// allocating their own. Compare an aligned and a misaligned placement.
+int bench_pmd_share(const BenchConfig *cfg) {
+    if (cfg->mode.mode != MODE_2M) {
+        fprintf(stderr, "Error: PMD sharing only exists for 2MB HugeTLB pages (mode 2m).\n");
+        return 1;
+    }
+    if (cfg->size % PAGE_SIZE_1G != 0) {
+        fprintf(stderr, "Error: Size must be a multiple of 1GB; PMD pages are shared per 1GB (PUD) range.\n");
+        return 1;
+    }
+
+    int fd;
+    if (cfg->file.path) {
+        // An existing file is left as it is and must cover <size>; only a file
+        // created here is sized. The mapping is always read-write, and
+        // hugetlbfs files cannot be written with write().
+        FileOptions file = cfg->file;
+        file.prefill = 0;
+        file.read_only = 0;
+        fd = open_data_file(&file, cfg->size);
+        struct statfs sfs;
+        if (fd < 0 || fstatfs(fd, &sfs) != 0) {
+            fprintf(stderr, "Error: Could not open %s: %s\n", cfg->file.path, strerror(errno));
+            if (fd >= 0) close(fd);
+            return 1;
+        }
+        if (sfs.f_type != HUGETLBFS_MAGIC) {
+            fprintf(stderr, "Error: %s is not on a hugetlbfs mount.\n", cfg->file.path);
+            close(fd);
+            return 1;
+        }
+    } else {
+        fd = memfd_create("mmap_overhead_pmd_share", MFD_CLOEXEC | MFD_HUGETLB | MFD_HUGE_2MB);
+        if (fd < 0) {
+            fprintf(stderr, "Error: memfd_create(MFD_HUGETLB) failed: %s\n", strerror(errno));
+            return 1;
+        }
+        if (ftruncate(fd, (off_t)cfg->size) != 0) {
+            fprintf(stderr, "Error: ftruncate failed: %s\n", strerror(errno));
+            close(fd);
+            return 1;
+        }
+    }
+
+    printf("--- hugetlb PMD Sharing Benchmark ---\n");
+    printf("File: %s, %zu GB of 2MB pages, each process touches %.0f%% of it\n",
+           cfg->file.path ? cfg->file.path : "memfd (MFD_HUGETLB)", cfg->size / PAGE_SIZE_1G,
+           cfg->touch_fraction * 100);
+
+    // One PMD page (4kB) maps 1GB of 2MB pages; that is what each process
+    // would pay for the file without sharing
+    long unshared_kb = (long)(cfg->size / PAGE_SIZE_1G) * (long)(PAGE_SIZE_4K / 1024);
+    const size_t shifts[] = {0, PAGE_SIZE_2M};
+    const char *layouts[] = {"1GB-aligned", "misaligned by 2MB"};
+    int rc = 0;
+
+    ChildReport *reports = calloc((size_t)cfg->procs, sizeof(ChildReport));
+    if (!reports) rc = 1;
+
+    // Each forked process also copies the parent's private page tables. Measure
+    // that with processes that touch nothing, so only the file's share remains.
+    double base_per_proc = 0;
+    if (rc == 0) {
+        BenchConfig idle = *cfg;
+        idle.touch_fraction = 0;
+        char dummy;
+        long base = run_sharing_round(&idle, &dummy, 0, cfg->procs, reports);
+        if (base < 0) rc = 1;
+        else base_per_proc = (double)base / cfg->procs;
+        printf("Base cost of a forked process (no file access): %.1f kB\n", base_per_proc);
+    }
+
+    for (int l = 0; l < 2 && rc == 0; l++) {
+        void *reserve;
+        size_t reserve_len;
+        void *addr = map_at_pud_offset(fd, cfg->size, shifts[l], &reserve, &reserve_len);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+            rc = 1;
+            break;
+        }
+        size_t fault_offset;
+        touch_memory(addr, cfg->size, PAGE_SIZE_2M, TOUCH_WRITE, &fault_offset);
+        if (fault_offset != SIZE_MAX) {
+            fprintf(stderr, "Error: SIGBUS while populating the file at offset %zu (pool too small?).\n",
+                    fault_offset);
+            munmap(reserve, reserve_len);
+            rc = 1;
+            break;
+        }
+
+        printf("\nLayout: %s (address %p)\n", layouts[l], addr);
+        printf("%6s %16s %14s %16s %20s\n", "Procs", "PageTables(kB)", "Per-proc(kB)",
+               "File/proc(kB)", "Unshared PMD/proc(kB)");
+        long last_total = 0;
+        int last_n = 1;
+        for (int n = 1; n > 0; n = next_proc_count(n, cfg->procs)) {
+            long total = run_sharing_round(cfg, addr, cfg->size, n, reports);
+            if (total < 0) { rc = 1; break; }
+            printf("%6d %16ld %14.1f %16.1f %20ld\n", n, total, (double)total / n,
+                   (double)total / n - base_per_proc, unshared_kb);
+            last_total = total;
+            last_n = n;
+        }
+        if (rc == 0 && last_n > 1) {
+            // Every process still pays for its upper levels; only the PMD pages can be shared
+            double per_proc = (double)last_total / last_n - base_per_proc;
+            if (per_proc < PAGE_SIZE_4K / 1024 / 2.0) {
+                printf("Verdict: PageTables stays flat - PMD pages are shared\n");
+            } else if (per_proc < unshared_kb * 0.75) {
+                printf("Verdict: Partially shared - only fully covered 1GB ranges share PMD pages\n");
+            } else {
+                printf("Verdict: PageTables grows per process - no PMD sharing\n");
+            }
+        }
+        munmap(reserve, reserve_len);
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Sharing needs MAP_SHARED hugetlb mappings of the same file range at\n");
+    printf("      the same offset within a 1GB (PUD) region, covering the whole region.\n");
+    printf("      File/proc = Per-proc minus the base cost of a forked process.\n");
+    printf("--------------------------------------------------\n");
+
+    free(reports);
+    close(fd);
+    return rc;
+}
+
+// readahead window (read_ahead_kb) of the block device holding fd, or -1
+// when there is none (tmpfs and other virtual file systems)
+long long get_read_ahead_kb(int fd) {
+    struct stat st;
+    char path[128];
+    if (fstat(fd, &st) != 0 || major(st.st_dev) == 0) return -1;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/read_ahead_kb",
+             major(st.st_dev), minor(st.st_dev));
+    long long kb = read_ll_file(path);
+    if (kb < 0) {
+        // A partition has no queue of its own; use its disk's
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/read_ahead_kb",
+                 major(st.st_dev), minor(st.st_dev));
+        kb = read_ll_file(path);
+    }
+    return kb;
+}
+
+// Page indices a scan visits: a fixed random subset (fraction) of the pages,
+// in ascending or shuffled order. Returns a malloc'ed array of *count entries.
+size_t *build_access_order(size_t pages, double fraction, AccessPattern pattern, size_t *count) {
+    size_t *order = malloc((pages ? pages : 1) * sizeof(size_t));
+    if (!order) return NULL;
+    unsigned int seed = 1;
+    size_t n = 0;
+    for (size_t i = 0; i < pages; i++) {
+        if (fraction < 1.0 && (double)rand_r(&seed) / RAND_MAX >= fraction) continue;
+        order[n++] = i;
+    }
+    if (pattern == PATTERN_RANDOM) {
+        for (size_t i = n; i > 1; i--) {
+            size_t j = (size_t)rand_r(&seed) % i;
+            size_t tmp = order[i - 1];
+            order[i - 1] = order[j];
+            order[j] = tmp;
+        }
+    }
+    *count = n;
+    return order;
+}
+
+// Read a file from start to end so that all of it is in the page cache
+int warm_page_cache(int fd, size_t size) {
+    char *buf = malloc(1024 * 1024);
+    if (!buf) return -1;
+    for (size_t off = 0; off < size; ) {
+        ssize_t n = pread(fd, buf, 1024 * 1024, (off_t)off);
+        if (n <= 0) {
+            free(buf);
+            return -1;
+        }
+        off += (size_t)n;
+    }
+    free(buf);
+    return 0;
+}
+
+// Read faults on a file mapping map fault_around_bytes worth of neighbouring
+// page cache pages at once, and readahead (tuned by MADV_SEQUENTIAL/RANDOM/
+// WILLNEED) decides how much of the file is in the cache to be mapped. Scan
+// the file with each hint, from a cold and a warm cache, and compare the PTEs
+// populated with the pages actually accessed.
+int bench_fault_around(const BenchConfig *cfg) {
+    const char *fault_around_path = "/sys/kernel/debug/fault_around_bytes";
+    if (!cfg->file.path || (cfg->mode.mode != MODE_4K && cfg->mode.mode != MODE_THP)) {
+        fprintf(stderr, "Error: The fault-around benchmark needs --file and mode 4k or thp.\n");
+        return 1;
+    }
+    FileOptions file = cfg->file;
+    file.read_only = 1; // Fault-around only happens on read faults
+    file.prefill = 1;   // Holes in a sparse file are not read ahead
+    int fd = open_data_file(&file, cfg->size);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open %s: %s\n", file.path, strerror(errno));
+        return 1;
+    }
+
+    long long fault_around_orig = read_ll_file(fault_around_path);
+    if (cfg->fault_around_bytes >= 0) {
+        if (fault_around_orig < 0 || write_ll_file(fault_around_path, cfg->fault_around_bytes) != 0) {
+            fprintf(stderr, "Error: Could not set %s (needs root and an accessible debugfs; "
+                    "the value must be a power of two up to 64kB).\n", fault_around_path);
+            close(fd);
+            return 1;
+        }
+    }
+    long long fault_around = read_ll_file(fault_around_path);
+    long long read_ahead_kb = get_read_ahead_kb(fd);
+
+    size_t pages = cfg->size / PAGE_SIZE_4K;
+    size_t accessed = 0;
+    size_t *order = build_access_order(pages, cfg->touch_fraction, cfg->pattern, &accessed);
+    unsigned char *residency = malloc(pages ? pages : 1);
+    if (!order || !residency || accessed == 0) {
+        fprintf(stderr, "Error: %s\n", accessed == 0 && order && residency
+                ? "--touch-fraction selects no pages." : "Out of memory.");
+        free(order);
+        free(residency);
+        close(fd);
+        return 1;
+    }
+
+    printf("--- Fault-Around and Readahead Benchmark ---\n");
+    printf("File: %s, %zu MB, %s scan of %zu of %zu pages\n", file.path, cfg->size / (1024 * 1024),
+           cfg->pattern == PATTERN_RANDOM ? "random" : "sequential", accessed, pages);
+    if (fault_around >= 0) printf("fault_around_bytes: %lld\n", fault_around);
+    else printf("fault_around_bytes: unknown (debugfs not accessible; kernel default 65536)\n");
+    if (read_ahead_kb >= 0) printf("read_ahead_kb: %lld\n", read_ahead_kb);
+    else printf("read_ahead_kb: n/a (no block device)\n");
+
+    const int hints[] = {-1, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED};
+    const char *hint_names[] = {"none", "SEQUENTIAL", "RANDOM", "WILLNEED"};
+    const char *cache_names[] = {"cold", "warm"};
+    int rc = 0;
+    printf("%-11s %-5s %8s %9s %7s %10s %10s %9s %8s %9s\n", "Hint", "Cache", "Cached%",
+           "Faults", "Major", "Faults/MB", "Populated", "Accessed", "Pop/Acc", "MB/s");
+    for (int h = 0; h < 4 && rc == 0; h++) {
+        for (int warm = 0; warm < 2; warm++) {
+            if (warm) {
+                if (warm_page_cache(fd, cfg->size) != 0) {
+                    fprintf(stderr, "Error: Reading %s failed: %s\n", file.path, strerror(errno));
+                    rc = 1;
+                    break;
+                }
+            } else {
+                // Clean, unmapped pages are dropped right away
+                posix_fadvise(fd, 0, (off_t)cfg->size, POSIX_FADV_DONTNEED);
+            }
+
+            void *addr = mmap(NULL, cfg->size, PROT_READ,
+                              region_mmap_flags(&cfg->mode, BACKING_FILE, 0, &file), fd, 0);
+            if (addr == MAP_FAILED) {
+                fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+                rc = 1;
+                break;
+            }
+            advise_region(addr, cfg->size, &cfg->mode, BACKING_FILE, cfg->thp_status);
+            size_t cached = 0;
+            if (mincore(addr, cfg->size, residency) == 0) {
+                for (size_t i = 0; i < pages; i++) cached += residency[i] & 1;
+            }
+
+            volatile const char *ptr = (volatile const char *)addr;
+            unsigned long sum = 0;
+            long minor_before, major_before, minor_after, major_after;
+            get_fault_counts(&minor_before, &major_before);
+            uint64_t start = now_ns();
+            if (hints[h] >= 0 && madvise(addr, cfg->size, hints[h]) != 0) {
+                fprintf(stderr, "Warning: madvise(MADV_%s) failed: %s\n", hint_names[h], strerror(errno));
+            }
+            for (size_t i = 0; i < accessed; i++) {
+                sum += (unsigned char)ptr[order[i] * PAGE_SIZE_4K];
+            }
+            uint64_t elapsed = now_ns() - start;
+            get_fault_counts(&minor_after, &major_after);
+            (void)sum;
+
+            long populated = count_present_pages(addr, cfg->size);
+            munmap(addr, cfg->size);
+
+            long faults = (minor_after - minor_before) + (major_after - major_before);
+            double accessed_mb = (double)accessed * PAGE_SIZE_4K / (1024 * 1024);
+            printf("%-11s %-5s %7.1f%% %9ld %7ld %10.1f %10ld %9zu %8.2f %9.1f\n",
+                   hint_names[h], cache_names[warm], 100.0 * cached / pages, faults,
+                   major_after - major_before, faults / accessed_mb, populated, accessed,
+                   (double)populated / accessed, accessed_mb / (elapsed / 1e9));
+        }
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Cached%% is the page cache residency before the scan. Pop/Acc above 1\n");
+    printf("      means PTEs were set up for pages that were never accessed (fault-around\n");
+    printf("      or a PMD-mapped large folio); every 512 of them can cost a 4kB PTE page.\n");
+    printf("      MB/s counts only the accessed pages; WILLNEED includes the madvise call.\n");
+    printf("--------------------------------------------------\n");
+
+    if (cfg->fault_around_bytes >= 0 && write_ll_file(fault_around_path, fault_around_orig) != 0) {
+        fprintf(stderr, "Warning: Could not restore %s to %lld.\n", fault_around_path, fault_around_orig);
+    }
+    free(order);
+    free(residency);
+    close(fd);
+    return rc;
+}
+
+// One pass of block reads from a file into a buffer, shared by the I/O threads
+typedef struct {
+    int fd;
+    char *buf;
+    size_t block_size;
+    size_t blocks;
+    size_t next;           // Next block to read (atomic)
+    uint64_t *latency_ns;  // Per block
+    int error;             // First errno seen (atomic)
+} DirectIoJob;
+
+// Thread body: read blocks until the pass is done. Block i of the file lands at
+// offset i of the buffer, so every page of the buffer is pinned once per pass.
+void *direct_io_worker(void *arg) {
+    DirectIoJob *job = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->blocks) break;
+        off_t off = (off_t)(i * job->block_size);
+        uint64_t start = now_ns();
+        ssize_t n = pread(job->fd, job->buf + off, job->block_size, off);
+        job->latency_ns[i] = now_ns() - start;
+        if (n != (ssize_t)job->block_size) {
+            int err = n < 0 ? errno : EIO;
+            int none = 0;
+            __atomic_compare_exchange_n(&job->error, &none, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    return NULL;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// User + system CPU time of the whole process (all threads) in ns
+uint64_t process_cpu_ns() {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+    return ((uint64_t)ru.ru_utime.tv_sec + (uint64_t)ru.ru_stime.tv_sec) * 1000000000ULL +
+           ((uint64_t)ru.ru_utime.tv_usec + (uint64_t)ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+// Open the benchmark's test file for O_DIRECT reads of size bytes. A new file
+// is written out (holes would be served without I/O) and flushed first.
+int open_direct_file(const FileOptions *opts, size_t size) {
+    FileOptions file = *opts;
+    file.prefill = 1;
+    file.read_only = 1;
+    int fd = open_data_file(&file, size);
+    if (fd < 0) return -1;
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+    int direct = open(fd_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return direct;
+}
+
+// Common setup of the I/O benchmarks: the --file test file opened O_DIRECT and
+// a populated <size> buffer of the selected mode. Returns 0, or 1 after an error.
+int setup_io_bench(const BenchConfig *cfg, const char *bench, int *fd, char **buf, int *buf_fd) {
+    if (!cfg->file.path) {
+        fprintf(stderr, "Error: The %s benchmark needs --file on a local file system.\n", bench);
+        return 1;
+    }
+    if (cfg->backing == BACKING_FILE || cfg->backing == BACKING_TMPFS) {
+        fprintf(stderr, "Error: The %s buffer must be anonymous memory (private, shared, memfd or sysv).\n", bench);
+        return 1;
+    }
+    if (cfg->block_size % PAGE_SIZE_4K != 0 || cfg->size % cfg->block_size != 0) {
+        fprintf(stderr, "Error: --block-size must be a multiple of 4kB that divides the size.\n");
+        return 1;
+    }
+
+    *fd = open_direct_file(&cfg->file, cfg->size);
+    if (*fd < 0) {
+        fprintf(stderr, "Error: Could not open %s with O_DIRECT: %s\n", cfg->file.path, strerror(errno));
+        if (errno == EINVAL) fprintf(stderr, "  Hint: The file system does not support O_DIRECT.\n");
+        return 1;
+    }
+    *buf = map_region(cfg->size, &cfg->mode, cfg->backing, cfg->extra_flags, NULL, buf_fd);
+    if (*buf == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map the %s buffer: %s\n", cfg->mode.name, strerror(errno));
+        close(*fd);
+        return 1;
+    }
+    advise_region(*buf, cfg->size, &cfg->mode, cfg->backing, cfg->thp_status);
+    // Fault the buffer in up front so the reads measure pinning, not page faults
+    size_t fault_offset;
+    touch_memory(*buf, cfg->size, cfg->mode.touch_step_size, TOUCH_WRITE, &fault_offset);
+    if (fault_offset != SIZE_MAX) {
+        fprintf(stderr, "Error: SIGBUS while populating the buffer at offset %zu.\n", fault_offset);
+        unmap_region(*buf, cfg->size, cfg->backing, *buf_fd);
+        close(*fd);
+        return 1;
+    }
+    return 0;
+}
+
+// Buffer-pool style O_DIRECT reads: get_user_pages pins the destination pages
+// of every request, which is cheaper for pages backed by huge pages. Read the
+// file into a buffer of the selected mode with 1, 2, 4, ... --threads threads.
+int bench_direct_io(const BenchConfig *cfg) {
+    int fd, buf_fd;
+    char *buf;
+    if (setup_io_bench(cfg, "direct-io", &fd, &buf, &buf_fd) != 0) return 1;
+
+    size_t blocks = cfg->size / cfg->block_size;
+    uint64_t *latency = malloc(blocks * sizeof(uint64_t));
+    pthread_t *tids = malloc((size_t)cfg->threads * sizeof(pthread_t));
+    int rc = 0;
+    if (!latency || !tids) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        rc = 1;
+    }
+
+    printf("--- O_DIRECT Read Benchmark ---\n");
+    printf("File: %s, %zu MB into a %s %s buffer, %zu kB blocks\n", cfg->file.path,
+           cfg->size / (1024 * 1024), backing_name(cfg->backing), cfg->mode.name, cfg->block_size / 1024);
+    printf("%7s %9s %12s %12s %12s %11s %8s\n", "Threads", "GB/s", "Lat avg(us)", "Lat p50(us)",
+           "Lat p99(us)", "CPU s/GB", "CPU%");
+    for (int n = 1; n > 0 && rc == 0; n = next_proc_count(n, cfg->threads)) {
+        DirectIoJob job = {fd, buf, cfg->block_size, blocks, 0, latency, 0};
+        uint64_t cpu_before = process_cpu_ns();
+        uint64_t start = now_ns();
+        int started = 0;
+        for (; started < n; started++) {
+            if (pthread_create(&tids[started], NULL, direct_io_worker, &job) != 0) {
+                fprintf(stderr, "Error: pthread_create failed.\n");
+                rc = 1;
+                break;
+            }
+        }
+        for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+        uint64_t elapsed = now_ns() - start;
+        uint64_t cpu = process_cpu_ns() - cpu_before;
+        if (rc != 0) break;
+        if (job.error) {
+            fprintf(stderr, "Error: pread failed: %s\n", strerror(job.error));
+            rc = 1;
+            break;
+        }
+
+        uint64_t total = 0;
+        for (size_t i = 0; i < blocks; i++) total += latency[i];
+        qsort(latency, blocks, sizeof(uint64_t), compare_u64);
+        double gb = (double)cfg->size / PAGE_SIZE_1G;
+        printf("%7d %9.2f %12.1f %12.1f %12.1f %11.3f %7.0f%%\n", n, gb / (elapsed / 1e9),
+               (double)total / blocks / 1000, latency[blocks / 2] / 1000.0,
+               latency[blocks * 99 / 100] / 1000.0, cpu / 1e9 / gb, 100.0 * cpu / elapsed);
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Each row reads the whole file once. Latency is per pread call; CPU\n");
+    printf("      is user + system time of all threads, including pinning the buffer.\n");
+    printf("--------------------------------------------------\n");
+
+    free(latency);
+    free(tids);
+    unmap_region(buf, cfg->size, cfg->backing, buf_fd);
+    close(fd);
+    return rc;
+}
+
+// A minimal io_uring instance driven through the raw system calls
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+} IoRing;
+
+void io_ring_close(IoRing *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_len);
+    close(ring->fd);
+}
+
+// Create a ring with at least entries submission slots. Returns 0, or -1 with errno set.
+int io_ring_setup(unsigned entries, IoRing *ring) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_len > ring->sq_ring_len) ring->sq_ring_len = ring->cq_ring_len;
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+    ring->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring
+        : mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) goto fail;
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail: ;
+    int err = errno;
+    io_ring_close(ring);
+    errno = err;
+    return -1;
+}
+
+// Read the whole file into buf with up to depth requests in flight, as
+// READ_FIXED from the registered buffers (chunk bytes each) or as plain READ.
+// Returns 0, or the errno of the first failed request.
+int io_ring_read_pass(IoRing *ring, int fd, char *buf, size_t size, size_t block_size,
+                      unsigned depth, int fixed, size_t chunk) {
+    size_t blocks = size / block_size;
+    size_t prepared = 0, completed = 0;
+    unsigned inflight = 0;
+    unsigned pending = 0; // In the SQ ring, not yet taken by the kernel
+    while (completed < blocks) {
+        unsigned tail = *ring->sq_tail;
+        while (inflight + pending < depth && prepared < blocks) {
+            unsigned idx = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[idx];
+            size_t off = prepared * block_size;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t)(buf + off);
+            sqe->len = (uint32_t)block_size;
+            sqe->off = off;
+            if (fixed) sqe->buf_index = (uint16_t)(off / chunk);
+            sqe->user_data = prepared;
+            ring->sq_array[idx] = idx;
+            tail++;
+            pending++;
+            prepared++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        // A short submit or EINTR leaves the rest pending for the next call
+        long ret = syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN) return errno;
+        if (ret > 0) {
+            inflight += (unsigned)ret;
+            pending -= (unsigned)ret;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->res != (int)block_size) {
+                __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+                return cqe->res < 0 ? -cqe->res : EIO;
+            }
+            completed++;
+            inflight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// io_uring fixed buffers: IORING_REGISTER_BUFFERS pins and accounts the whole
+// buffer once, so READ_FIXED requests skip the per-I/O get_user_pages. Time
+// the registration for the selected mode and compare fixed with plain reads.
+int bench_io_uring(const BenchConfig *cfg) {
+    IoRing ring;
+    unsigned depth = (unsigned)cfg->threads;
+    if (io_ring_setup(depth, &ring) != 0) {
+        int err = errno;
+        printf("io_uring is not available: %s (kernel.io_uring_disabled = %lld)\n", strerror(err),
+               read_ll_file("/proc/sys/kernel/io_uring_disabled"));
+        printf("Falling back to synchronous O_DIRECT reads with threads.\n");
+        return bench_direct_io(cfg);
+    }
+    // One registered buffer may span at most 1GB
+    size_t chunk = cfg->size < PAGE_SIZE_1G ? cfg->size : PAGE_SIZE_1G;
+    if (chunk % cfg->block_size != 0) {
+        fprintf(stderr, "Error: --block-size must divide 1GB (the largest registered buffer).\n");
+        io_ring_close(&ring);
+        return 1;
+    }
+    int fd, buf_fd;
+    char *buf;
+    if (setup_io_bench(cfg, "io-uring", &fd, &buf, &buf_fd) != 0) {
+        io_ring_close(&ring);
+        return 1;
+    }
+
+    printf("--- io_uring Fixed Buffer Benchmark ---\n");
+    printf("File: %s, %zu MB into a %s %s buffer, %zu kB blocks\n", cfg->file.path,
+           cfg->size / (1024 * 1024), backing_name(cfg->backing), cfg->mode.name, cfg->block_size / 1024);
+
+    size_t nr_iovecs = (cfg->size + chunk - 1) / chunk;
+    struct iovec *iov = calloc(nr_iovecs, sizeof(struct iovec));
+    int rc = iov ? 0 : 1;
+    int registered = 0;
+    for (size_t i = 0; i < nr_iovecs && iov; i++) {
+        iov[i].iov_base = buf + i * chunk;
+        // The last buffer ends with the mapping when <size> is not a multiple of 1GB
+        iov[i].iov_len = cfg->size - i * chunk < chunk ? cfg->size - i * chunk : chunk;
+    }
+    if (iov) {
+        uint64_t start = now_ns();
+        long r = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, (unsigned)nr_iovecs);
+        uint64_t elapsed = now_ns() - start;
+        if (r == 0) {
+            registered = 1;
+            printf("IORING_REGISTER_BUFFERS: %.3f ms for %zu buffer(s), %.1f ns per 4kB page\n",
+                   elapsed / 1e6, nr_iovecs, (double)elapsed / (cfg->size / PAGE_SIZE_4K));
+        } else {
+            int err = errno;
+            printf("Warning: IORING_REGISTER_BUFFERS failed: %s (errno %d)\n", strerror(err), err);
+            if (err == ENOMEM) {
+                printf("  Hint: Registered buffers count against RLIMIT_MEMLOCK (ulimit -l) without CAP_IPC_LOCK.\n");
+            }
+            printf("Only plain reads are measured.\n");
+        }
+    }
+
+    printf("%7s %12s %14s %12s %14s\n", "QD", "Fixed GB/s", "Fixed CPU s/GB", "Plain GB/s", "Plain CPU s/GB");
+    double gb = (double)cfg->size / PAGE_SIZE_1G;
+    for (unsigned qd = 1; qd > 0 && rc == 0; qd = (unsigned)next_proc_count((int)qd, (int)depth)) {
+        double gbps[2] = {0, 0}, cpu_per_gb[2] = {0, 0};
+        for (int fixed = 1; fixed >= 0 && rc == 0; fixed--) {
+            if (fixed && !registered) continue;
+            uint64_t cpu_before = process_cpu_ns();
+            uint64_t start = now_ns();
+            int err = io_ring_read_pass(&ring, fd, buf, cfg->size, cfg->block_size, qd, fixed, chunk);
+            uint64_t elapsed = now_ns() - start;
+            if (err) {
+                fprintf(stderr, "Error: io_uring %s failed: %s\n", fixed ? "READ_FIXED" : "READ", strerror(err));
+                rc = 1;
+                break;
+            }
+            gbps[fixed] = gb / (elapsed / 1e9);
+            cpu_per_gb[fixed] = (process_cpu_ns() - cpu_before) / 1e9 / gb;
+        }
+        if (rc != 0) break;
+        if (registered) printf("%7u %12.2f %14.3f %12.2f %14.3f\n", qd, gbps[1], cpu_per_gb[1], gbps[0], cpu_per_gb[0]);
+        else printf("%7u %12s %14s %12.2f %14.3f\n", qd, "-", "-", gbps[0], cpu_per_gb[0]);
+    }
+
+    if (registered) {
+        uint64_t start = now_ns();
+        syscall(__NR_io_uring_register, ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        printf("IORING_UNREGISTER_BUFFERS: %.3f ms\n", (now_ns() - start) / 1e6);
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Each row reads the whole file once per read type. Plain READ pins the\n");
+    printf("      buffer pages of every request; READ_FIXED uses the registration.\n");
+    printf("--------------------------------------------------\n");
+
+    free(iov);
+    io_ring_close(&ring);
+    unmap_region(buf, cfg->size, cfg->backing, buf_fd);
+    close(fd);
+    return rc;
+}
+
+// Map a memfd of size bytes twice back to back, so that accesses running past
+// the end continue at the start (wrap-free ring buffer). Returns the base
+// address of the 2 * size window, or MAP_FAILED with errno set. The window
+// starts at a multiple of align (0: any page), which HugeTLB views need.
+void *map_double_ring(int fd, size_t size, size_t align) {
+    // Reserve the window first so the two views land next to each other
+    size_t reserve_len = 2 * size + align;
+    char *reserve = mmap(NULL, reserve_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserve == MAP_FAILED) return MAP_FAILED;
+    char *base = reserve;
+    if (align) base = (char *)(((uintptr_t)reserve + align - 1) & ~(uintptr_t)(align - 1));
+    // Trim the alignment slack, so that the caller unmaps exactly 2 * size
+    if (base > reserve) munmap(reserve, (size_t)(base - reserve));
+    if (reserve + reserve_len > base + 2 * size) {
+        munmap(base + 2 * size, (size_t)(reserve + reserve_len - (base + 2 * size)));
+    }
+    for (int view = 0; view < 2; view++) {
+        if (mmap(base + view * size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            int err = errno;
+            munmap(base, 2 * size);
+            errno = err;
+            return MAP_FAILED;
+        }
+    }
+    return base;
+}
+
+// Wrap-free ring buffers: one memfd mapped twice back to back, so a record
+// that wraps is still contiguous. Every ring pays for page tables twice.
+// Build 1, 2, 4, ... --rings rings of <size> each and stream records through them.
+int bench_ring(const BenchConfig *cfg) {
+    const ModeConfig *mc = &cfg->mode;
+    if (cfg->block_size == 0 || cfg->block_size > cfg->size) {
+        fprintf(stderr, "Error: --block-size (the record size) must not exceed the ring size.\n");
+        return 1;
+    }
+    unsigned int mfd_flags = MFD_CLOEXEC;
+    if (mc->mode == MODE_2M) mfd_flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+    if (mc->mode == MODE_1G) mfd_flags |= MFD_HUGETLB | MFD_HUGE_1GB;
+    if (!(mfd_flags & MFD_HUGETLB) && cfg->size % PAGE_SIZE_4K != 0) {
+        fprintf(stderr, "Error: The ring size must be a multiple of 4kB.\n");
+        return 1;
+    }
+    if (mc->huge_page_size && cfg->size % mc->huge_page_size != 0) {
+        fprintf(stderr, "Error: The ring size must be a multiple of the %zu kB huge page size.\n",
+                mc->huge_page_size / 1024);
+        return 1;
+    }
+    // HugeTLB views must start on a huge page boundary; align THP too so shmem can use PMDs
+    size_t align = mc->huge_page_size ? mc->huge_page_size : (mc->mode == MODE_THP ? PAGE_SIZE_2M : 0);
+
+    int *fds = malloc((size_t)cfg->rings * sizeof(int));
+    char **rings = malloc((size_t)cfg->rings * sizeof(char *));
+    char *record = malloc(cfg->block_size);
+    char *sink = malloc(cfg->block_size);
+    if (!fds || !rings || !record || !sink) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free(fds); free(rings); free(record); free(sink);
+        return 1;
+    }
+    memset(record, 0x5a, cfg->block_size);
+    if (mc->mode == MODE_THP && cfg->backing != BACKING_MEMFD) {
+        report_shmem_thp_policy(mc, BACKING_MEMFD, NULL); // main() reported it for --backing only
+    }
+
+    printf("--- Double-Mapped Ring Buffer Benchmark ---\n");
+    printf("Ring: %zu MB memfd%s (%s) mapped twice, %zu-byte records\n", cfg->size / (1024 * 1024),
+           (mfd_flags & MFD_HUGETLB) ? " (MFD_HUGETLB)" : "", mc->name, cfg->block_size);
+    size_t entry_size = mc->huge_page_size ? mc->huge_page_size : PAGE_SIZE_4K;
+    size_t theoretical_per_ring = 2 * calculate_overhead(cfg->size, entry_size);
+    printf("%6s %8s %12s %16s %16s %14s %14s\n", "Rings", "VMAs", "VmPTE(kB)", "Per-ring(kB)",
+           "Theoretical(kB)", "Produce GB/s", "Consume GB/s");
+
+    int rc = 0;
+    long vmas_base = count_vmas();
+    long vmpte_base = get_vmpte_kb();
+    int built = 0;
+    for (int n = 1; n > 0 && rc == 0; n = next_proc_count(n, cfg->rings)) {
+        for (; built < n; built++) {
+            fds[built] = memfd_create("mmap_overhead_ring", mfd_flags);
+            if (fds[built] < 0 || ftruncate(fds[built], (off_t)cfg->size) != 0) {
+                fprintf(stderr, "Error: Could not create ring memfd %d: %s\n", built, strerror(errno));
+                if (fds[built] >= 0) close(fds[built]);
+                rc = 1;
+                break;
+            }
+            rings[built] = map_double_ring(fds[built], cfg->size, align);
+            if (rings[built] == MAP_FAILED) {
+                fprintf(stderr, "Error: Could not map ring %d: %s\n", built, strerror(errno));
+                if (errno == ENOMEM && (mfd_flags & MFD_HUGETLB)) {
+                    fprintf(stderr, "  Hint: Every ring needs <size> of HugeTLB pages; --provision covers one ring.\n");
+                }
+                close(fds[built]);
+                rc = 1;
+                break;
+            }
+            // THP for shmem is given per mapping, so both views need the hint
+            advise_region(rings[built], 2 * cfg->size, mc, BACKING_MEMFD, cfg->thp_status);
+            // Populate both views, as a long-running ring eventually does
+            size_t fault_offset;
+            touch_memory(rings[built], 2 * cfg->size, mc->touch_step_size, TOUCH_WRITE, &fault_offset);
+            if (fault_offset != SIZE_MAX) {
+                fprintf(stderr, "Error: SIGBUS while populating ring %d at offset %zu.\n", built, fault_offset);
+                munmap(rings[built], 2 * cfg->size);
+                close(fds[built]);
+                rc = 1;
+                break;
+            }
+        }
+        if (rc != 0) break;
+
+        // Stream two ring sizes of records through each ring: a producer pass
+        // fills the ring with records, then a consumer pass drains them. Each
+        // pass is timed as a whole. The head starts half a record before the
+        // end, so records keep crossing the wrap.
+        uint64_t produce_ns = 0, consume_ns = 0;
+        size_t bytes = 0;
+        size_t per_pass = cfg->size / cfg->block_size;
+        for (int r = 0; r < n; r++) {
+            size_t head = cfg->size - cfg->block_size / 2;
+            for (int lap = 0; lap < 2; lap++) {
+                uint64_t start = now_ns();
+                for (size_t i = 0; i < per_pass; i++) {
+                    memcpy(rings[r] + (head + i * cfg->block_size) % cfg->size, record, cfg->block_size);
+                }
+                uint64_t mid = now_ns();
+                for (size_t i = 0; i < per_pass; i++) {
+                    memcpy(sink, rings[r] + (head + i * cfg->block_size) % cfg->size, cfg->block_size);
+                }
+                consume_ns += now_ns() - mid;
+                produce_ns += mid - start;
+                head += per_pass * cfg->block_size;
+                bytes += per_pass * cfg->block_size;
+            }
+        }
+        long vmas = count_vmas();
+        long vmpte = get_vmpte_kb();
+        double gb = (double)bytes / PAGE_SIZE_1G;
+        printf("%6d %8ld %12ld %16.1f %16.1f %14.2f %14.2f\n", n, vmas - vmas_base, vmpte - vmpte_base,
+               (double)(vmpte - vmpte_base) / n, theoretical_per_ring / 1024.0,
+               gb / (produce_ns / 1e9), gb / (consume_ns / 1e9));
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: VMAs and VmPTE are the growth since before the first ring; each ring\n");
+    printf("      adds two VMAs. Theoretical counts lowest-level entries for both views.\n");
+    printf("      Produce and Consume are whole passes over a ring in one thread.\n");
+    printf("--------------------------------------------------\n");
+
+    for (int r = 0; r < built; r++) {
+        munmap(rings[r], 2 * cfg->size);
+        close(fds[r]);
+    }
+    free(fds); free(rings); free(record); free(sink);
+    return rc;
+}
+
+// Open a per-thread counter for user-space iTLB read misses. Returns the
+// descriptor, or -1 with errno set (no PMU in VMs, perf_event_paranoid).
+int open_itlb_miss_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Generate one small function with a data-dependent branch at code:
+// int f(int x) { int r = x + imm; if (x & 1) r += 7; return r; }
+// Returns the number of bytes written, or 0 if the architecture is not supported.
+size_t emit_branchy_function(unsigned char *code, unsigned char imm) {
+#if defined(__x86_64__)
+    const unsigned char body[] = {
+        0x8d, 0x47, imm,        // lea eax, [rdi + imm]
+        0x40, 0xf6, 0xc7, 0x01, // test dil, 1
+        0x74, 0x03,             // jz ret
+        0x83, 0xc0, 0x07,       // add eax, 7
+        0xc3                    // ret
+    };
+    memcpy(code, body, sizeof(body));
+    return sizeof(body);
+#else
+    (void)code;
+    (void)imm;
+    return 0;
+#endif
+}
+
+// Stores the result of the generated calls so the compiler cannot drop them
+volatile int itlb_sink;
+
+// Executable code on huge pages: fill a <size> region of the selected mode
+// with one small JIT-generated function per 4kB page, then call functions at
+// random from a growing span of it and count the iTLB misses.
+int bench_itlb(const BenchConfig *cfg) {
+    const ModeConfig *mc = &cfg->mode;
+    if (cfg->backing != BACKING_PRIVATE) {
+        fprintf(stderr, "Error: The itlb benchmark maps its code anonymously (--backing=private).\n");
+        return 1;
+    }
+    unsigned char probe[16];
+    if (emit_branchy_function(probe, 0) == 0) {
+        fprintf(stderr, "Error: The itlb benchmark only generates x86-64 code.\n");
+        return 1;
+    }
+
+    int fd;
+    unsigned char *code = map_region(cfg->size, mc, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+    if (code == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map the code region: %s\n", strerror(errno));
+        return 1;
+    }
+    advise_region(code, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+    // Spread the functions over the cache sets instead of putting all at page offset 0
+    size_t nfuncs = cfg->size / PAGE_SIZE_4K;
+    for (size_t i = 0; i < nfuncs; i++) {
+        emit_branchy_function(code + i * PAGE_SIZE_4K + (i * 64) % PAGE_SIZE_4K, (unsigned char)i);
+    }
+    if (mprotect(code, cfg->size, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "Error: mprotect(PROT_EXEC) failed: %s\n", strerror(errno));
+        unmap_region(code, cfg->size, BACKING_PRIVATE, fd);
+        return 1;
+    }
+
+    int perf_fd = open_itlb_miss_counter();
+    printf("--- iTLB Benchmark ---\n");
+    printf("Code: %zu MB of %s pages, %zu functions (one per 4kB page)\n", cfg->size / (1024 * 1024),
+           mc->name, nfuncs);
+    if (mc->mode == MODE_THP) {
+        printf("AnonHugePages of the code region: %ld kB\n", get_smaps_kb(code, "AnonHugePages"));
+    }
+    if (perf_fd < 0) {
+        printf("iTLB misses: n/a (perf_event_open: %s; perf_event_paranoid = %lld)\n", strerror(errno),
+               read_ll_file("/proc/sys/kernel/perf_event_paranoid"));
+    }
+    printf("%10s %12s %10s %14s %18s\n", "Span(MB)", "Calls", "ns/call", "iTLB misses",
+           "Misses/1000 calls");
+
+    const size_t calls = 1 << 24;
+    size_t span = cfg->size < PAGE_SIZE_2M ? cfg->size : PAGE_SIZE_2M;
+    for (;;) {
+        size_t span_funcs = span / PAGE_SIZE_4K;
+        uint32_t x = 0x9e3779b9;
+        int acc = 0;
+        if (perf_fd >= 0) {
+            ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        uint64_t start = now_ns();
+        for (size_t c = 0; c < calls; c++) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5; // xorshift32
+            size_t i = (size_t)(((uint64_t)x * span_funcs) >> 32);
+            int (*fn)(int) = (int (*)(int))(void *)(code + i * PAGE_SIZE_4K + (i * 64) % PAGE_SIZE_4K);
+            acc = fn(acc);
+        }
+        uint64_t elapsed = now_ns() - start;
+        long long misses = -1;
+        if (perf_fd >= 0) {
+            ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(perf_fd, &misses, sizeof(misses)) != (ssize_t)sizeof(misses)) misses = -1;
+        }
+        if (misses >= 0) {
+            printf("%10.1f %12zu %10.2f %14lld %18.2f\n", (double)span / (1024 * 1024), calls,
+                   (double)elapsed / calls, misses, misses * 1000.0 / calls);
+        } else {
+            printf("%10.1f %12zu %10.2f %14s %18s\n", (double)span / (1024 * 1024), calls,
+                   (double)elapsed / calls, "n/a", "n/a");
+        }
+        itlb_sink = acc; // Keep the call results alive
+        if (span == cfg->size) break;
+        span = span * 2 < cfg->size ? span * 2 : cfg->size;
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Each call jumps to a random function of the span through an indirect\n");
+    printf("      call; every function sits on its own 4kB page.\n");
+    printf("--------------------------------------------------\n");
+
+    if (perf_fd >= 0) close(perf_fd);
+    unmap_region(code, cfg->size, BACKING_PRIVATE, fd);
+    return 0;
+}
+
+// A thread stack with its guard, laid out like glibc does it: the guard is
+// the PROT_NONE bottom of the mapping, the stack the usable rest above it
+typedef struct {
+    char *map;        // Start of the guard + stack mapping
+    size_t map_len;
+    char *stack;      // Lowest usable stack address
+    uint64_t create_ns; // Stack mapping + pthread_create
+} ThreadStack;
+
+// Map a stack of cfg->size bytes with a cfg->guard_size guard below it. THP
+// and HugeTLB stacks are aligned to their page size so they can use it.
+int map_thread_stack(const BenchConfig *cfg, ThreadStack *ts) {
+    const ModeConfig *mc = &cfg->mode;
+    size_t align = mc->huge_page_size ? mc->huge_page_size : (mc->mode == MODE_THP ? PAGE_SIZE_2M : 0);
+    size_t reserve_len = cfg->guard_size + cfg->size + align;
+    char *base = mmap(NULL, reserve_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return -1;
+
+    char *stack = base + cfg->guard_size;
+    if (align) stack = (char *)(((uintptr_t)stack + align - 1) & ~(uintptr_t)(align - 1));
+    int ok;
+    if (mc->huge_page_size) {
+        ok = mmap(stack, cfg->size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_STACK | mc->mmap_flags | cfg->extra_flags,
+                  -1, 0) != MAP_FAILED;
+    } else {
+        ok = mprotect(stack, cfg->size, PROT_READ | PROT_WRITE) == 0;
+        if (ok) advise_region(stack, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+    }
+    if (!ok) {
+        int err = errno;
+        munmap(base, reserve_len);
+        errno = err;
+        return -1;
+    }
+    // Trim the alignment slack, keeping exactly the guard below the stack
+    char *map = stack - cfg->guard_size;
+    char *end = stack + cfg->size;
+    if (map > base) munmap(base, (size_t)(map - base));
+    if (base + reserve_len > end) munmap(end, (size_t)(base + reserve_len - end));
+    ts->map = map;
+    ts->map_len = cfg->guard_size + cfg->size;
+    ts->stack = stack;
+    return 0;
+}
+
+// Shared state of one thread-stack round
+typedef struct {
+    size_t touch_depth;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int touched;   // Threads that have used their stacks
+    int released;  // The main thread has taken its readings
+} StackRound;
+
+// Use touch_depth bytes of the thread's stack, then wait to be released
+void *stack_thread(void *arg) {
+    StackRound *round = arg;
+    volatile char *frame = alloca(round->touch_depth);
+    for (size_t i = 0; i < round->touch_depth; i += PAGE_SIZE_4K) frame[i] = 1;
+    pthread_mutex_lock(&round->lock);
+    round->touched++;
+    pthread_cond_broadcast(&round->cond);
+    while (!round->released) pthread_cond_wait(&round->cond, &round->lock);
+    pthread_mutex_unlock(&round->lock);
+    return NULL;
+}
+
+// Thread-per-connection: every thread stack is its own mapping plus a guard
+// VMA, and gets its own page tables for the part that is used. Start 1, 2,
+// 4, ... --threads threads with <size> stacks of the selected mode.
+int bench_thread_stacks(const BenchConfig *cfg) {
+    const ModeConfig *mc = &cfg->mode;
+    if (cfg->touch_depth + 64 * 1024 > cfg->size) {
+        fprintf(stderr, "Error: --touch-depth must leave at least 64kB of the %zu-byte stack.\n", cfg->size);
+        return 1;
+    }
+    ThreadStack *stacks = calloc((size_t)cfg->threads, sizeof(ThreadStack));
+    pthread_t *tids = calloc((size_t)cfg->threads, sizeof(pthread_t));
+    if (!stacks || !tids) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free(stacks);
+        free(tids);
+        return 1;
+    }
+
+    printf("--- Thread Stack Benchmark ---\n");
+    printf("Stacks: %zu kB of %s pages, %zu kB guard, %zu kB used per thread\n", cfg->size / 1024,
+           mc->name, cfg->guard_size / 1024, cfg->touch_depth / 1024);
+    printf("%8s %8s %12s %16s %16s %16s\n", "Threads", "VMAs", "VmPTE(kB)", "PTE/thread(kB)",
+           "Create avg(us)", "Create max(us)");
+    int rc = 0;
+    for (int n = 1; n > 0 && rc == 0; n = next_proc_count(n, cfg->threads)) {
+        StackRound round = {cfg->touch_depth, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+        long vmas_before = count_vmas();
+        long vmpte_before = get_vmpte_kb();
+
+        int started = 0;
+        for (; started < n; started++) {
+            ThreadStack *ts = &stacks[started];
+            uint64_t start = now_ns();
+            if (map_thread_stack(cfg, ts) != 0) {
+                fprintf(stderr, "Error: Could not map stack %d: %s\n", started, strerror(errno));
+                rc = 1;
+                break;
+            }
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setstack(&attr, ts->stack, cfg->size);
+            int err = pthread_create(&tids[started], &attr, stack_thread, &round);
+            pthread_attr_destroy(&attr);
+            ts->create_ns = now_ns() - start;
+            if (err != 0) {
+                fprintf(stderr, "Error: pthread_create failed: %s\n", strerror(err));
+                munmap(ts->map, ts->map_len);
+                rc = 1;
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&round.lock);
+        while (round.touched < started) pthread_cond_wait(&round.cond, &round.lock);
+        pthread_mutex_unlock(&round.lock);
+        long vmas = count_vmas() - vmas_before;
+        long vmpte = get_vmpte_kb() - vmpte_before;
+        pthread_mutex_lock(&round.lock);
+        round.released = 1;
+        pthread_cond_broadcast(&round.cond);
+        pthread_mutex_unlock(&round.lock);
+
+        uint64_t total_ns = 0, max_ns = 0;
+        for (int t = 0; t < started; t++) {
+            pthread_join(tids[t], NULL);
+            munmap(stacks[t].map, stacks[t].map_len);
+            total_ns += stacks[t].create_ns;
+            if (stacks[t].create_ns > max_ns) max_ns = stacks[t].create_ns;
+        }
+        if (rc != 0) break;
+        printf("%8d %8ld %12ld %16.1f %16.1f %16.1f\n", n, vmas, vmpte, (double)vmpte / n,
+               (double)total_ns / n / 1000, max_ns / 1000.0);
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: VMAs and VmPTE are the growth while all threads are alive. Create\n");
+    printf("      is mapping the stack and guard plus pthread_create.\n");
+    printf("--------------------------------------------------\n");
+    free(stacks);
+    free(tids);
+    return rc;
+}
+
+// Fault the first page of up to 4096 random mappings of the first count and
+// return the average time per fault in ns; MADV_DONTNEED makes them fresh again
+double sample_fault_latency(char **maps, long count, size_t size, unsigned int *seed) {
+    long samples = count < 4096 ? count : 4096;
+    uint64_t total = 0;
+    for (long s = 0; s < samples; s++) {
+        volatile char *p = maps[(long)(rand_r(seed) % count)];
+        uint64_t start = now_ns();
+        *p = 1;
+        total += now_ns() - start;
+        madvise((void *)p, size, MADV_DONTNEED);
+    }
+    return (double)total / samples;
+}
+
+// Per-object mmap allocators: many small mappings, each its own VMA. Create
+// --mappings mappings of <size> and see how mmap, faults and munmap scale with
+// the VMA count, and what the VMAs themselves cost.
+int bench_vma_count(const BenchConfig *cfg) {
+    const ModeConfig *mc = &cfg->mode;
+    // The gap (or guard) keeps neighbouring mappings from merging into one VMA
+    size_t gap = mc->huge_page_size ? mc->huge_page_size : PAGE_SIZE_4K;
+    size_t stride = cfg->size + gap;
+    int vmas_per_mapping = cfg->guards ? 2 : 1;
+    long max_map_count = read_ll_file("/proc/sys/vm/max_map_count");
+    if (max_map_count < 0 && cfg->mappings <= 0) {
+        fprintf(stderr, "Error: Cannot read vm.max_map_count; pass --mappings.\n");
+        return 1;
+    }
+    long headroom = max_map_count < 0 ? cfg->mappings : (max_map_count - count_vmas() - 64) / vmas_per_mapping;
+    if (max_map_count < 0) printf("Warning: Cannot read vm.max_map_count; not capping --mappings.\n");
+    long k = cfg->mappings > 0 ? cfg->mappings : headroom;
+    if (k > headroom) {
+        printf("Capping the mappings to %ld (vm.max_map_count = %ld)\n", headroom, max_map_count);
+        k = headroom;
+    }
+    if (k < 1) {
+        fprintf(stderr, "Error: No room left below vm.max_map_count.\n");
+        return 1;
+    }
+
+    char **maps = calloc((size_t)k, sizeof(char *));
+    if (!maps) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    // Find a free range for all mappings, then place them with MAP_FIXED_NOREPLACE
+    size_t span = (size_t)k * stride + gap;
+    char *base = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not reserve %zu MB of address space: %s\n", span >> 20, strerror(errno));
+        free(maps);
+        return 1;
+    }
+    munmap(base, span);
+    base = (char *)(((uintptr_t)base + gap - 1) & ~(uintptr_t)(gap - 1));
+
+    printf("--- VMA Count Benchmark ---\n");
+    printf("Mappings: %ld x %zu kB of %s pages, %s\n", k, cfg->size / 1024, mc->name,
+           cfg->guards ? "each followed by a PROT_NONE guard" : "separated by unmapped gaps");
+    printf("%9s %8s %10s %14s %16s %14s %10s\n", "Mappings", "VMAs", "mmap/s", "Fault avg(ns)",
+           "vm_area_struct", "maple_node", "VmPTE");
+    printf("%9s %8s %10s %14s %16s %14s %10s\n", "", "", "", "", "(kB)", "(kB)", "(kB)");
+
+    long vmas_base = count_vmas();
+    long vma_slab_base = get_slab_kb("vm_area_struct");
+    long maple_slab_base = get_slab_kb("maple_node");
+    long vmpte_base = get_vmpte_kb();
+    unsigned int seed = 1;
+    int rc = 0;
+    long created = 0;
+    long checkpoint = k < 1024 ? k : 1024;
+    while (created < k) {
+        uint64_t mmap_ns = 0;
+        long batch_start = created;
+        for (; created < checkpoint; created++) {
+            char *want = base + (size_t)created * stride;
+            uint64_t start = now_ns();
+            char *p = mmap(want, cfg->size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | mc->mmap_flags | cfg->extra_flags,
+                           -1, 0);
+            if (p != MAP_FAILED && cfg->guards &&
+                mmap(want + cfg->size, gap, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+                munmap(p, cfg->size);
+                p = MAP_FAILED;
+            }
+            mmap_ns += now_ns() - start;
+            if (p == MAP_FAILED) {
+                fprintf(stderr, "Error: mmap of mapping %ld failed: %s\n", created, strerror(errno));
+                rc = 1;
+                break;
+            }
+            advise_region(p, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+            maps[created] = p;
+        }
+        if (rc != 0) break;
+
+        double fault_ns = sample_fault_latency(maps, created, cfg->size, &seed);
+        long vma_slab = get_slab_kb("vm_area_struct");
+        long maple_slab = get_slab_kb("maple_node");
+        printf("%9ld %8ld %10.0f %14.0f ", created, count_vmas() - vmas_base,
+               (created - batch_start) / (mmap_ns / 1e9), fault_ns);
+        if (vma_slab >= 0) printf("%16ld ", vma_slab - vma_slab_base);
+        else printf("%16s ", "n/a");
+        if (maple_slab >= 0) printf("%14ld ", maple_slab - maple_slab_base);
+        else printf("%14s ", "n/a");
+        printf("%10ld\n", get_vmpte_kb() - vmpte_base);
+        checkpoint = checkpoint * 2 < k ? checkpoint * 2 : k;
+    }
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < created; i++) {
+        munmap(maps[i], cfg->guards ? stride : cfg->size);
+    }
+    uint64_t munmap_ns = now_ns() - start;
+    if (created > 0) {
+        printf("munmap: %.0f mappings/s (%ld mappings in %.1f ms)\n", created / (munmap_ns / 1e9),
+               created, munmap_ns / 1e6);
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: mmap/s covers the mappings added since the previous row (with their\n");
+    printf("      guards). Fault avg is a first-touch fault in a random mapping. Slab\n");
+    printf("      and VmPTE columns are the growth since the start (slabs need root).\n");
+    printf("--------------------------------------------------\n");
+    free(maps);
+    return rc;
+}
+
+// One thread of a concurrent fault round: fault in its slice, one fault per
+// step, once the main thread sets *go
+typedef struct {
+    char *addr;
+    size_t len;
+    size_t step;
+    const int *go;
+    uint64_t *latency_ns;  // One entry per fault
+} FaultWorker;
+
+void *fault_worker(void *arg) {
+    FaultWorker *w = arg;
+    while (!__atomic_load_n(w->go, __ATOMIC_ACQUIRE)) sched_yield();
+    volatile char *p = (volatile char *)w->addr;
+    size_t n = 0;
+    for (size_t off = 0; off < w->len; off += w->step) {
+        uint64_t start = now_ns();
+        p[off] = 1;
+        w->latency_ns[n++] = now_ns() - start;
+    }
+    return NULL;
+}
+
+// mmap/munmap churn that keeps taking mmap_lock for writing
+typedef struct {
+    int stop;
+    long ops;
+} ChurnState;
+
+void *churn_worker(void *arg) {
+    ChurnState *c = arg;
+    while (!__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) {
+        char *p = mmap(NULL, 64 * 1024, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) continue;
+        p[0] = 1;
+        munmap(p, 64 * 1024);
+        c->ops++;
+    }
+    return NULL;
+}
+
+// Fault <size> in with n threads, each in its own slice of one shared VMA or
+// of its own VMA, optionally next to a churn thread. Prints one table row.
+int run_fault_round(const BenchConfig *cfg, int n, int per_thread_vmas, int churn) {
+    const ModeConfig *mc = &cfg->mode;
+    size_t step = mc->touch_step_size;
+    size_t slice = cfg->size / (size_t)n / step * step;
+    if (slice == 0) {
+        fprintf(stderr, "Error: <size> is too small for %d threads.\n", n);
+        return 1;
+    }
+    size_t faults_per_thread = slice / step;
+    char **maps = calloc((size_t)n, sizeof(char *));
+    FaultWorker *workers = calloc((size_t)n, sizeof(FaultWorker));
+    pthread_t *tids = calloc((size_t)n, sizeof(pthread_t));
+    uint64_t *latency = malloc((size_t)n * faults_per_thread * sizeof(uint64_t));
+    int nmaps = per_thread_vmas ? n : 1;
+    size_t map_len = per_thread_vmas ? slice : slice * (size_t)n;
+    int rc = (!maps || !workers || !tids || !latency) ? 1 : 0;
+    // Per-thread slices are placed at a stride of slice + gap in a free range,
+    // so that neighbouring slices cannot merge into one VMA
+    size_t gap = mc->huge_page_size ? mc->huge_page_size : (mc->mode == MODE_THP ? PAGE_SIZE_2M : PAGE_SIZE_4K);
+    size_t stride = slice + gap;
+    char *base = NULL;
+    if (rc == 0 && per_thread_vmas) {
+        size_t span = (size_t)n * stride + gap;
+        base = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            fprintf(stderr, "Error: Could not reserve %zu MB of address space: %s\n", span >> 20, strerror(errno));
+            rc = 1;
+        } else {
+            munmap(base, span);
+            base = (char *)(((uintptr_t)base + gap - 1) & ~(uintptr_t)(gap - 1));
+        }
+    }
+    long vmas_before = count_vmas();
+    int mapped = 0;
+    for (; rc == 0 && mapped < nmaps; mapped++) {
+        int fd;
+        if (per_thread_vmas) {
+            maps[mapped] = mmap(base + (size_t)mapped * stride, map_len, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | mc->mmap_flags | cfg->extra_flags,
+                                -1, 0);
+        } else {
+            maps[mapped] = map_region(map_len, mc, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+        }
+        if (maps[mapped] == MAP_FAILED) {
+            fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+            rc = 1;
+            break;
+        }
+        advise_region(maps[mapped], map_len, mc, BACKING_PRIVATE, cfg->thp_status);
+    }
+    if (rc == 0 && per_thread_vmas && count_vmas() - vmas_before < n) {
+        fprintf(stderr, "Error: %d slices were mapped but only %ld VMAs were added.\n", n,
+                count_vmas() - vmas_before);
+        rc = 1;
+    }
+
+    int go = 0;
+    ChurnState churn_state = {0, 0};
+    pthread_t churn_tid;
+    int started = 0, churn_started = 0;
+    long long vma_locked = get_vmstat("vma_lock_success"), vma_aborted = get_vmstat("vma_lock_abort");
+    for (; rc == 0 && started < n; started++) {
+        FaultWorker *w = &workers[started];
+        w->addr = per_thread_vmas ? maps[started] : maps[0] + (size_t)started * slice;
+        w->len = slice;
+        w->step = step;
+        w->go = &go;
+        w->latency_ns = latency + (size_t)started * faults_per_thread;
+        if (pthread_create(&tids[started], NULL, fault_worker, w) != 0) {
+            fprintf(stderr, "Error: pthread_create failed.\n");
+            rc = 1;
+            break;
+        }
+    }
+    if (rc == 0 && churn) {
+        churn_started = pthread_create(&churn_tid, NULL, churn_worker, &churn_state) == 0;
+        if (!churn_started) {
+            fprintf(stderr, "Error: pthread_create failed.\n");
+            rc = 1;
+        }
+    }
+    uint64_t start = now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE); // On error too, so started threads finish
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    uint64_t elapsed = now_ns() - start;
+    if (churn_started) {
+        __atomic_store_n(&churn_state.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(churn_tid, NULL);
+    }
+
+    if (rc == 0) {
+        size_t total = (size_t)n * faults_per_thread;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < total; i++) sum += latency[i];
+        qsort(latency, total, sizeof(uint64_t), compare_u64);
+        printf("%-10s %-5s %7d %12.0f %12.2f %12.2f ", per_thread_vmas ? "per-thread" : "shared",
+               churn ? "on" : "off", n, total / (elapsed / 1e9), (double)sum / total / 1000,
+               latency[total * 99 / 100] / 1000.0);
+        if (churn) printf("%12.0f", churn_state.ops / (elapsed / 1e9));
+        else printf("%12s", "-");
+        if (vma_locked >= 0) {
+            printf(" %10lld %8lld", get_vmstat("vma_lock_success") - vma_locked,
+                   get_vmstat("vma_lock_abort") - vma_aborted);
+        }
+        printf("\n");
+    }
+    for (int m = 0; m < mapped; m++) munmap(maps[m], map_len);
+    free(maps);
+    free(workers);
+    free(tids);
+    free(latency);
+    return rc;
+}
+
+// Per-VMA locks (Linux 6.4+) let page faults in different VMAs, or in one
+// VMA, proceed without mmap_lock. Compare threads faulting into slices of one
+// shared VMA with threads that each have their own VMA, with and without a
+// thread that keeps taking mmap_lock for writing.
+int bench_vma_lock(const BenchConfig *cfg) {
+    int with_lock_stats = get_vmstat("vma_lock_success") >= 0;
+    printf("--- Per-VMA Lock Fault Scaling Benchmark ---\n");
+    printf("%zu MB of %s pages faulted in by 1..%d threads\n", cfg->size / (1024 * 1024),
+           cfg->mode.name, cfg->threads);
+    printf("%-10s %-5s %7s %12s %12s %12s %12s%s\n", "VMAs", "Churn", "Threads", "Faults/s",
+           "Lat avg(us)", "Lat p99(us)", "Churn ops/s", with_lock_stats ? "  VMA-locked  Aborted" : "");
+    int rc = 0;
+    for (int layout = 0; layout < 2 && rc == 0; layout++) {
+        for (int churn = 0; churn < 2 && rc == 0; churn++) {
+            for (int n = 1; n > 0 && rc == 0; n = next_proc_count(n, cfg->threads)) {
+                rc = run_fault_round(cfg, n, layout, churn);
+            }
+        }
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Churn is a thread doing mmap/touch/munmap of 64kB in a loop, which\n");
+    printf("      takes mmap_lock for writing. Faults fall back to mmap_lock when the\n");
+    printf("      per-VMA lock is contended or unsupported for the mapping.\n");
+    if (!with_lock_stats) {
+        printf("      vma_lock_* counters need CONFIG_PER_VMA_LOCK_STATS and are not shown.\n");
+    }
+    printf("--------------------------------------------------\n");
+    return rc;
+}
+
+// Allocator-style churn of one thread: map, touch and unmap <size> again and
+// again, or keep one mapping and alternate touching it with MADV_DONTNEED
+typedef struct {
+    const BenchConfig *cfg;
+    int dontneed;
+    const int *stop;
+    long ops;
+    int error;
+} ChurnWorker;
+
+void *allocator_churn_worker(void *arg) {
+    ChurnWorker *w = arg;
+    const BenchConfig *cfg = w->cfg;
+    const ModeConfig *mc = &cfg->mode;
+    int fd;
+    size_t fault_offset;
+    char *keep = NULL;
+    if (w->dontneed) {
+        keep = map_region(cfg->size, mc, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+        if (keep == MAP_FAILED) {
+            w->error = errno;
+            return NULL;
+        }
+        advise_region(keep, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+    }
+    while (!__atomic_load_n(w->stop, __ATOMIC_ACQUIRE)) {
+        if (w->dontneed) {
+            touch_memory_armed(keep, cfg->size, mc->touch_step_size, TOUCH_WRITE, &fault_offset);
+            madvise(keep, cfg->size, MADV_DONTNEED);
+        } else {
+            char *p = map_region(cfg->size, mc, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+            if (p == MAP_FAILED) {
+                w->error = errno;
+                break;
+            }
+            advise_region(p, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+            touch_memory_armed(p, cfg->size, mc->touch_step_size, TOUCH_WRITE, &fault_offset);
+            munmap(p, cfg->size);
+        }
+        if (fault_offset != SIZE_MAX) {
+            w->error = EFAULT;
+            break;
+        }
+        w->ops++;
+    }
+    if (keep) munmap(keep, cfg->size);
+    return NULL;
+}
+
+// Steady-state allocator behaviour: 1, 2, 4, ... --threads threads each churn
+// <size> allocations for a second, by munmap or by MADV_DONTNEED
+int bench_churn(const BenchConfig *cfg) {
+    const double seconds = 1.0;
+    pthread_t *tids = calloc((size_t)cfg->threads, sizeof(pthread_t));
+    ChurnWorker *workers = calloc((size_t)cfg->threads, sizeof(ChurnWorker));
+    if (!tids || !workers) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free(tids);
+        free(workers);
+        return 1;
+    }
+    long long tlb_base = get_tlb_shootdowns();
+    printf("--- Allocation Churn Benchmark ---\n");
+    printf("Allocation: %zu kB of %s pages, %.0f s per row\n", cfg->size / 1024, cfg->mode.name, seconds);
+    printf("%-9s %7s %12s %16s %16s %14s\n", "Release", "Threads", "Ops/s", "Ops/s/thread",
+           "PTE peak(kB)", "Shootdowns/op");
+    struct sigaction old_sa;
+    arm_touch_fault_handler(&old_sa); // Once for all workers
+    int rc = 0;
+    for (int dontneed = 0; dontneed < 2 && rc == 0; dontneed++) {
+        for (int n = 1; n > 0 && rc == 0; n = next_proc_count(n, cfg->threads)) {
+            int stop = 0;
+            long vmpte_base = get_vmpte_kb();
+            long long tlb_before = get_tlb_shootdowns();
+            int started = 0;
+            for (; started < n; started++) {
+                workers[started] = (ChurnWorker){cfg, dontneed, &stop, 0, 0};
+                if (pthread_create(&tids[started], NULL, allocator_churn_worker, &workers[started]) != 0) {
+                    fprintf(stderr, "Error: pthread_create failed.\n");
+                    rc = 1;
+                    break;
+                }
+            }
+            // Sample the page tables while the threads run
+            long vmpte_peak = vmpte_base;
+            uint64_t start = now_ns();
+            while (rc == 0 && now_ns() - start < (uint64_t)(seconds * 1e9)) {
+                long v = get_vmpte_kb();
+                if (v > vmpte_peak) vmpte_peak = v;
+                usleep(5000);
+            }
+            __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+            long ops = 0;
+            for (int t = 0; t < started; t++) {
+                pthread_join(tids[t], NULL);
+                ops += workers[t].ops;
+                if (workers[t].error && rc == 0) {
+                    fprintf(stderr, "Error: Churn thread failed: %s\n", strerror(workers[t].error));
+                    rc = 1;
+                }
+            }
+            double elapsed = (now_ns() - start) / 1e9;
+            if (rc != 0) break;
+            long long tlb = get_tlb_shootdowns();
+            printf("%-9s %7d %12.0f %16.0f %16ld ", dontneed ? "DONTNEED" : "munmap", n, ops / elapsed,
+                   ops / elapsed / n, vmpte_peak - vmpte_base);
+            if (tlb_base >= 0 && ops > 0) printf("%14.3f\n", (double)(tlb - tlb_before) / ops);
+            else printf("%14s\n", "n/a");
+        }
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: One op maps (or reuses), touches and releases one allocation. PTE peak\n");
+    printf("      is the highest VmPTE growth sampled every 5 ms. Shootdowns are TLB\n");
+    printf("      IPIs from /proc/interrupts; they need threads on other CPUs.\n");
+    printf("--------------------------------------------------\n");
+    sigaction(SIGBUS, &old_sa, NULL);
+    free(tids);
+    free(workers);
+    return rc;
+}
+
+// How a growing mapping is laid out relative to its neighbours
+typedef enum {
+    GROW_IN_PLACE,       // Free address space behind the mapping
+    GROW_MOVE,           // A blocker page right behind it forces a move
+    GROW_MOVE_MISALIGNED // Same, starting 4kB past a 2MB boundary (thp)
+} GrowLayout;
+
+// Map <size>, then grow it by <size> per step with mremap(MREMAP_MAYMOVE),
+// populating each new part. Prints one row per step.
+int run_growth_pass(const BenchConfig *cfg, GrowLayout layout) {
+    const ModeConfig *mc = &cfg->mode;
+    const char *layout_names[] = {"in place", "moved", "moved, misaligned start"};
+    const char *huge_key = mc->huge_page_size ? "Private_Hugetlb" : "AnonHugePages";
+    size_t final_len = cfg->size * (size_t)(cfg->steps + 1);
+    size_t align = mc->huge_page_size ? mc->huge_page_size : PAGE_SIZE_2M;
+    size_t offset = layout == GROW_MOVE_MISALIGNED ? PAGE_SIZE_4K : 0;
+
+    // Find a range with room for the final size, then map the start of it
+    char *range = mmap(NULL, final_len + align + offset, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (range == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not reserve address space: %s\n", strerror(errno));
+        return 1;
+    }
+    munmap(range, final_len + align + offset);
+    char *want = (char *)(((uintptr_t)range + align - 1) & ~(uintptr_t)(align - 1)) + offset;
+    char *addr = mmap(want, cfg->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | mc->mmap_flags | cfg->extra_flags, -1, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+        return 1;
+    }
+    advise_region(addr, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+    size_t fault_offset;
+    touch_memory(addr, cfg->size, mc->touch_step_size, TOUCH_WRITE, &fault_offset);
+
+    printf("\nLayout: %s (start %p)\n", layout_names[layout], (void *)addr);
+    printf("%5s %10s %14s %6s %10s %10s %8s\n", "Step", "Size(MB)", "mremap(us)", "Moved",
+           "VmPTE(kB)", "Huge(kB)", "Huge%");
+    size_t len = cfg->size;
+    char *blocker = NULL;
+    int rc = 0;
+    for (int step = 0; step <= cfg->steps && rc == 0; step++) {
+        uint64_t elapsed = 0;
+        int moved = 0;
+        if (step > 0) {
+            if (layout != GROW_IN_PLACE) {
+                blocker = mmap(addr + len, PAGE_SIZE_4K, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0);
+                if (blocker == MAP_FAILED) blocker = NULL;
+            }
+            size_t new_len = len + cfg->size;
+            uint64_t start = now_ns();
+            char *grown;
+            if (mc->huge_page_size) {
+                // HugeTLB mappings cannot be resized: map the new size and
+                // move the old pages to its start instead. Until the move the
+                // old pages stay mapped, so the pool must hold len + new_len.
+                HugePoolCounts pool;
+                long long needed = (long long)(new_len / mc->huge_page_size);
+                if (!(cfg->extra_flags & MAP_NORESERVE) &&
+                    read_hugepool_counts(mc->huge_page_size, -1, &pool) == 0 &&
+                    pool.free - (pool.resv > 0 ? pool.resv : 0) < needed) {
+                    fprintf(stderr, "Error: Step %d needs %lld free huge pages for the new %zu MB mapping while\n"
+                            "       the old %zu MB is still mapped (%zu MB at the peak); the pool has %lld.\n",
+                            step, needed, new_len >> 20, len >> 20, (len + new_len) >> 20,
+                            pool.free - (pool.resv > 0 ? pool.resv : 0));
+                    if (blocker) munmap(blocker, PAGE_SIZE_4K);
+                    rc = 1;
+                    break;
+                }
+                grown = mmap(NULL, new_len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | mc->mmap_flags | cfg->extra_flags, -1, 0);
+                if (grown != MAP_FAILED &&
+                    mremap(addr, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, grown) == MAP_FAILED) {
+                    int err = errno;
+                    munmap(grown, new_len);
+                    errno = err;
+                    grown = MAP_FAILED;
+                }
+            } else {
+                grown = mremap(addr, len, new_len, MREMAP_MAYMOVE);
+            }
+            elapsed = now_ns() - start;
+            if (blocker) {
+                munmap(blocker, PAGE_SIZE_4K);
+                blocker = NULL;
+            }
+            if (grown == MAP_FAILED) {
+                fprintf(stderr, "Error: mremap to %zu MB failed: %s\n", new_len >> 20, strerror(errno));
+                rc = 1;
+                break;
+            }
+            moved = grown != addr;
+            addr = grown;
+            // The hint only covers the old part if the VMA was extended in place
+            advise_region(addr, new_len, mc, BACKING_PRIVATE, cfg->thp_status);
+            touch_memory(addr + len, cfg->size, mc->touch_step_size, TOUCH_WRITE, &fault_offset);
+            len = new_len;
+        }
+        if (fault_offset != SIZE_MAX) {
+            fprintf(stderr, "Error: SIGBUS while populating at offset %zu (pool too small?).\n", fault_offset);
+            rc = 1;
+            break;
+        }
+        long huge_kb = mc->mode == MODE_4K ? 0 : get_smaps_range_kb(addr, len, huge_key);
+        printf("%5d %10zu %14.1f %6s %10ld %10ld %7.1f%%\n", step, len >> 20, elapsed / 1000.0,
+               step == 0 ? "-" : (moved ? "yes" : "no"), get_vmpte_kb(), huge_kb,
+               huge_kb > 0 ? 100.0 * huge_kb * 1024 / len : 0.0);
+    }
+    munmap(addr, len);
+    return rc;
+}
+
+// Growing a buffer pool online: mremap(MREMAP_MAYMOVE) moves page tables
+// instead of copying data. Grow a populated mapping step by step, once with
+// room to extend in place and once forced to move.
+int bench_mremap_grow(const BenchConfig *cfg) {
+    printf("--- mremap Growth Benchmark ---\n");
+    printf("Start %zu MB of %s pages, %d steps of %zu MB\n", cfg->size >> 20, cfg->mode.name,
+           cfg->steps, cfg->size >> 20);
+    if (cfg->mode.huge_page_size) {
+        size_t peak = cfg->size * (size_t)(2 * cfg->steps + 1);
+        printf("HugeTLB mappings cannot grow in place; each step maps the new size and moves\n");
+        printf("the old pages to its start with MREMAP_FIXED (timed together).\n");
+        printf("The last step needs %zu MB of pool (%zu huge pages): old and new mapping at once.\n",
+               peak >> 20, peak / cfg->mode.huge_page_size);
+    }
+    int rc = cfg->mode.huge_page_size ? 0 : run_growth_pass(cfg, GROW_IN_PLACE);
+    if (rc == 0) rc = run_growth_pass(cfg, GROW_MOVE);
+    if (rc == 0 && cfg->mode.mode == MODE_THP) rc = run_growth_pass(cfg, GROW_MOVE_MISALIGNED);
+    printf("--------------------------------------------------\n");
+    printf("NOTE: mremap(us) only covers the mremap call; the new part is populated\n");
+    printf("      afterwards. Huge is AnonHugePages (thp) or Private_Hugetlb of the\n");
+    printf("      grown range. A move keeps huge PMDs only at a 2MB-compatible address.\n");
+    printf("--------------------------------------------------\n");
+    return rc;
+}
+
+// Keep the process's mm active on another CPU until *stop is set, so that
+// changes to the page tables need TLB shootdown IPIs
+void *spin_worker(void *arg) {
+    const int *stop = arg;
+    while (!__atomic_load_n(stop, __ATOMIC_ACQUIRE)) {}
+    return NULL;
+}
+
+// Move --moves random pages of a half-full pool of page-sized slots to free
+// slots, by memcpy or by mremap(MREMAP_FIXED | MREMAP_DONTUNMAP). Prints one row.
+int run_relocation_pass(const BenchConfig *cfg, int use_mremap) {
+    const ModeConfig *mc = &cfg->mode;
+    size_t slot = mc->huge_page_size ? mc->huge_page_size : (mc->mode == MODE_THP ? PAGE_SIZE_2M : PAGE_SIZE_4K);
+    size_t nslots = cfg->size / slot;
+    size_t nused = nslots / 2;
+    int fd = -1;
+    char *pool;
+    if (mc->mode == MODE_THP) {
+        // Reserve and trim to a 2MB boundary, so that every slot can be one huge PMD
+        size_t reserve_len = cfg->size + PAGE_SIZE_2M;
+        char *reserve = mmap(NULL, reserve_len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | mc->mmap_flags | cfg->extra_flags, -1, 0);
+        pool = reserve;
+        if (reserve != MAP_FAILED) {
+            pool = (char *)(((uintptr_t)reserve + PAGE_SIZE_2M - 1) & ~(uintptr_t)(PAGE_SIZE_2M - 1));
+            if (pool > reserve) munmap(reserve, (size_t)(pool - reserve));
+            munmap(pool + cfg->size, (size_t)(reserve + reserve_len - (pool + cfg->size)));
+        }
+    } else {
+        pool = map_region(cfg->size, mc, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+    }
+    if (pool == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+        return 1;
+    }
+    advise_region(pool, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+    size_t *used = malloc(nused * sizeof(size_t));
+    size_t *free_slots = malloc((nslots - nused) * sizeof(size_t));
+    uint64_t *ids = malloc(nslots * sizeof(uint64_t));
+    if (!used || !free_slots || !ids) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free(used); free(free_slots); free(ids);
+        unmap_region(pool, cfg->size, BACKING_PRIVATE, fd);
+        return 1;
+    }
+    // memcpy needs resident destination frames; mremap brings its own pages
+    size_t fault_offset;
+    touch_memory(pool, use_mremap ? nused * slot : cfg->size, mc->touch_step_size, TOUCH_WRITE, &fault_offset);
+    for (size_t i = 0; i < nslots; i++) {
+        if (i < nused) {
+            used[i] = i;
+            ids[i] = i + 1;
+            *(uint64_t *)(pool + i * slot) = ids[i];
+        } else {
+            free_slots[i - nused] = i;
+        }
+    }
+
+    const char *huge_key = mc->huge_page_size ? "Private_Hugetlb" : "AnonHugePages";
+    long huge_before = get_smaps_range_kb(pool, cfg->size, huge_key);
+
+    int stop = 0;
+    int spinners = cfg->threads - 1;
+    pthread_t *tids = calloc((size_t)(spinners > 0 ? spinners : 1), sizeof(pthread_t));
+    int started = 0;
+    for (; tids && started < spinners; started++) {
+        if (pthread_create(&tids[started], NULL, spin_worker, &stop) != 0) break;
+    }
+
+    unsigned int seed = 1;
+    long done = 0;
+    int err = 0;
+    long long tlb_before = get_tlb_shootdowns();
+    uint64_t start = now_ns();
+    for (; done < cfg->moves; done++) {
+        size_t i = (size_t)rand_r(&seed) % nused;
+        size_t j = (size_t)rand_r(&seed) % (nslots - nused);
+        char *src = pool + used[i] * slot, *dst = pool + free_slots[j] * slot;
+        if (use_mremap) {
+            if (mremap(src, slot, slot, MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, dst) == MAP_FAILED) {
+                err = errno;
+                break;
+            }
+        } else {
+            memcpy(dst, src, slot);
+        }
+        ids[free_slots[j]] = ids[used[i]];
+        size_t tmp = used[i];
+        used[i] = free_slots[j];
+        free_slots[j] = tmp;
+    }
+    uint64_t elapsed = now_ns() - start;
+    long long tlb_after = get_tlb_shootdowns();
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+
+    int rc = 0;
+    const char *name = use_mremap ? "mremap" : "memcpy";
+    if (err == EINVAL && done == 0) {
+        printf("%-8s %s\n", name, "MREMAP_DONTUNMAP is not supported for this mapping (EINVAL)");
+    } else if (err) {
+        fprintf(stderr, "Error: mremap(MREMAP_DONTUNMAP) failed after %ld moves: %s\n", done, strerror(err));
+        if (err == ENOMEM) fprintf(stderr, "  Hint: Every moved page becomes its own VMA; vm.max_map_count may be reached.\n");
+        rc = 1;
+    } else {
+        size_t bad = 0;
+        for (size_t i = 0; i < nused; i++) {
+            if (*(uint64_t *)(pool + used[i] * slot) != ids[used[i]]) bad++;
+        }
+        printf("%-8s %10ld %12.0f %12.2f ", name, done, done / (elapsed / 1e9), elapsed / 1000.0 / done);
+        if (tlb_before >= 0) printf("%16.3f", (double)(tlb_after - tlb_before) / done);
+        else printf("%16s", "n/a");
+        printf(" %8ld %10s %10ld %10ld\n", count_vmas(), bad ? "CORRUPT" : "ok", huge_before,
+               get_smaps_range_kb(pool, cfg->size, huge_key));
+    }
+    free(tids);
+    free(used);
+    free(free_slots);
+    free(ids);
+    unmap_region(pool, cfg->size, BACKING_PRIVATE, fd);
+    return rc;
+}
+
+// Relocating pages inside a buffer manager: copy the data to a free slot, or
+// move the page frame there with mremap(MREMAP_FIXED | MREMAP_DONTUNMAP)
+int bench_relocate(const BenchConfig *cfg) {
+    const ModeConfig *mc = &cfg->mode;
+    size_t slot = mc->huge_page_size ? mc->huge_page_size : (mc->mode == MODE_THP ? PAGE_SIZE_2M : PAGE_SIZE_4K);
+    size_t nslots = cfg->size / slot;
+    long max_map_count = read_ll_file("/proc/sys/vm/max_map_count");
+    if (nslots < 2) {
+        fprintf(stderr, "Error: The pool needs at least two %zu kB slots.\n", slot / 1024);
+        return 1;
+    }
+    if (max_map_count < 0) {
+        printf("Warning: Cannot read vm.max_map_count; not checking the slots against it.\n");
+    } else if ((long)nslots > max_map_count - count_vmas() - 64) {
+        fprintf(stderr, "Error: %zu slots could need more VMAs than vm.max_map_count (%ld) allows.\n",
+                nslots, max_map_count);
+        return 1;
+    }
+    printf("--- Page Relocation Benchmark ---\n");
+    printf("Pool: %zu MB of %s pages, %zu slots of %zu kB, half in use; %ld moves, %d spinning thread(s)\n",
+           cfg->size >> 20, mc->name, nslots, slot / 1024, cfg->moves, cfg->threads - 1);
+    printf("%-8s %10s %12s %12s %16s %8s %10s %10s %10s\n", "Method", "Moves", "Moves/s", "us/move",
+           "Shootdowns/move", "VMAs", "Data", "Before(kB)", "After(kB)");
+    int rc = run_relocation_pass(cfg, 0);
+    if (rc == 0) rc = run_relocation_pass(cfg, 1);
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Shootdowns are TLB IPIs from /proc/interrupts; --threads - 1 threads\n");
+    printf("      spin on other CPUs so that they are needed. VMAs is the process total\n");
+    printf("      after the moves. Data checks each page still carries its marker.\n");
+    printf("      Before and After are AnonHugePages (thp) or Private_Hugetlb of the pool\n");
+    printf("      before and after the moves.\n");
+    printf("--------------------------------------------------\n");
+    return rc;
+}
+
+// Ways to get a mapping locked in memory
+typedef enum {
+    LOCK_NONE,        // Baseline: the touch loop
+    LOCK_MAP_LOCKED,  // mmap(MAP_LOCKED)
+    LOCK_MLOCK,       // mlock() after mmap
+    LOCK_ONFAULT,     // mlock2(MLOCK_ONFAULT), then the touch loop
+    LOCK_ALL_CURRENT, // mlockall(MCL_CURRENT) after mmap
+    LOCK_ALL_FUTURE   // mlockall(MCL_FUTURE) before mmap
+} LockMethod;
+
+// Locking fails with EAGAIN/ENOMEM/EPERM when RLIMIT_MEMLOCK is too small
+void print_memlock_hint(int err) {
+    if (err == ENOMEM || err == EPERM || err == EAGAIN) {
+        fprintf(stderr, "  Hint: Locking needs CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK (ulimit -l).\n");
+    }
+}
+
+// Map <size>, lock and populate it with one method and print one row.
+// Startup is everything from mmap until every page is resident.
+int run_lock_method(const BenchConfig *cfg, LockMethod method) {
+    const ModeConfig *mc = &cfg->mode;
+    const char *names[] = {"touch loop", "MAP_LOCKED", "mlock", "mlock2(ONFAULT)+touch",
+                           "mlockall(CURRENT)", "mlockall(FUTURE)"};
+    long vmpte_before = get_vmpte_kb();
+    uint64_t lock_ns = 0;
+    uint64_t start = now_ns();
+    if (method == LOCK_ALL_FUTURE && mlockall(MCL_FUTURE) != 0) {
+        int err = errno;
+        fprintf(stderr, "Error: mlockall(MCL_FUTURE) failed: %s\n", strerror(err));
+        print_memlock_hint(err);
+        return 1;
+    }
+    int fd;
+    int flags = cfg->extra_flags | (method == LOCK_MAP_LOCKED ? MAP_LOCKED : 0);
+    char *addr = map_region(cfg->size, mc, BACKING_PRIVATE, flags, NULL, &fd);
+    if (method == LOCK_MAP_LOCKED || method == LOCK_ALL_FUTURE) lock_ns = now_ns() - start;
+    if (addr == MAP_FAILED) {
+        int err = errno;
+        fprintf(stderr, "Error: mmap for %s failed: %s\n", names[method], strerror(err));
+        if (method == LOCK_MAP_LOCKED || method == LOCK_ALL_FUTURE) print_memlock_hint(err);
+        if (method == LOCK_ALL_FUTURE) munlockall();
+        return 1;
+    }
+    // The hint comes after mmap, so MAP_LOCKED and MCL_FUTURE populate without it
+    advise_region(addr, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+
+    int rc = 0;
+    uint64_t lock_start = now_ns();
+    switch (method) {
+        case LOCK_MLOCK: rc = mlock(addr, cfg->size); break;
+        case LOCK_ONFAULT: rc = mlock2(addr, cfg->size, MLOCK_ONFAULT); break;
+        case LOCK_ALL_CURRENT: rc = mlockall(MCL_CURRENT); break;
+        default: break;
+    }
+    if (method == LOCK_MLOCK || method == LOCK_ONFAULT || method == LOCK_ALL_CURRENT) {
+        lock_ns = now_ns() - lock_start;
+    }
+    if (rc != 0) {
+        int err = errno;
+        fprintf(stderr, "Error: %s failed: %s\n", names[method], strerror(err));
+        print_memlock_hint(err);
+        unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+        return 1;
+    }
+    if (method == LOCK_NONE || method == LOCK_ONFAULT) {
+        size_t fault_offset;
+        touch_memory(addr, cfg->size, mc->touch_step_size, TOUCH_WRITE, &fault_offset);
+    }
+    uint64_t startup_ns = now_ns() - start;
+
+    long huge_kb = get_smaps_kb(addr, mc->huge_page_size ? "Private_Hugetlb" : "AnonHugePages");
+    printf("%-22s %12.2f %12.2f %10ld %10ld %10ld\n", names[method], lock_ns / 1e6, startup_ns / 1e6,
+           get_status_kb("VmLck"), get_vmpte_kb() - vmpte_before, huge_kb);
+    if (method == LOCK_ALL_CURRENT || method == LOCK_ALL_FUTURE) munlockall();
+    unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+    return 0;
+}
+
+// Lock part of a THP-backed mapping and unlock 4kB in the middle of a huge
+// page: the VMA splits there, and so does the huge PMD mapping
+void check_partial_munlock(const BenchConfig *cfg) {
+    const ModeConfig *mc = &cfg->mode;
+    int fd;
+    char *addr = map_region(cfg->size, mc, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+    if (addr == MAP_FAILED) {
+        printf("Partial munlock skipped: mmap failed: %s\n", strerror(errno));
+        return;
+    }
+    advise_region(addr, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+    char *huge = (char *)(((uintptr_t)addr + PAGE_SIZE_2M - 1) & ~(uintptr_t)(PAGE_SIZE_2M - 1));
+    if (huge + PAGE_SIZE_2M > addr + cfg->size) {
+        printf("Partial munlock skipped: the mapping holds no aligned 2MB page (use a <size> of 4MB or more).\n");
+        unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+        return;
+    }
+    if (mlock(addr, cfg->size) != 0) {
+        int err = errno;
+        printf("Partial munlock skipped: mlock failed: %s\n", strerror(err));
+        print_memlock_hint(err);
+        unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+        return;
+    }
+    long huge_before = get_smaps_range_kb(addr, cfg->size, "AnonHugePages");
+    long vmas_before = count_vmas();
+    uint64_t start = now_ns();
+    int rc = munlock(huge + PAGE_SIZE_4K, PAGE_SIZE_4K);
+    int err = errno;
+    uint64_t elapsed = now_ns() - start;
+    long huge_after = get_smaps_range_kb(addr, cfg->size, "AnonHugePages");
+    if (rc == 0) {
+        printf("Partial munlock of 4kB inside a huge page: %.1f us, VMAs %+ld, AnonHugePages %ld -> %ld kB\n",
+               elapsed / 1000.0, count_vmas() - vmas_before, huge_before, huge_after);
+    } else {
+        printf("Partial munlock failed: %s\n", strerror(err));
+    }
+    unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+}
+
+// Locking a pool at startup: mlock faults every page in, like the touch loop.
+// Compare the locking variants with the touch loop for the selected mode.
+int bench_mlock(const BenchConfig *cfg) {
+    struct rlimit rl;
+    printf("--- mlock Benchmark ---\n");
+    printf("%zu MB of %s pages", cfg->size >> 20, cfg->mode.name);
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        printf(", RLIMIT_MEMLOCK %llu kB", (unsigned long long)rl.rlim_cur / 1024);
+    }
+    printf("\n%-22s %12s %12s %10s %10s %10s\n", "Method", "Lock(ms)", "Startup(ms)", "VmLck(kB)",
+           "VmPTE(kB)", "Huge(kB)");
+    // Fault the memory in once unmeasured: the first allocation of <size> may
+    // have to reclaim or compact memory, and the first row would pay for it
+    int fd;
+    char *warm = map_region(cfg->size, &cfg->mode, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+    if (warm != MAP_FAILED) {
+        size_t fault_offset;
+        touch_memory(warm, cfg->size, cfg->mode.touch_step_size, TOUCH_WRITE, &fault_offset);
+        unmap_region(warm, cfg->size, BACKING_PRIVATE, fd);
+    }
+    int rc = 0;
+    for (LockMethod m = LOCK_NONE; m <= LOCK_ALL_FUTURE && rc == 0; m++) {
+        rc = run_lock_method(cfg, m);
+    }
+    if (rc == 0 && cfg->mode.mode == MODE_THP) {
+        check_partial_munlock(cfg);
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Lock is the locking call (for MAP_LOCKED and MCL_FUTURE the mmap that\n");
+    printf("      populates); Startup runs from mmap until all pages are resident. VmPTE\n");
+    printf("      is the growth for the mapping; HugeTLB pages are not counted in VmLck.\n");
+    printf("--------------------------------------------------\n");
+    return rc;
+}
+
+// Clear the soft-dirty bits of the whole process (/proc/self/clear_refs)
+int clear_soft_dirty() {
+    return write_str_file("/proc/self/clear_refs", "4");
+}
+
+// A page written into a new mapping is soft-dirty, unless the kernel is built
+// without CONFIG_MEM_SOFT_DIRTY
+int soft_dirty_supported() {
+    char *p = mmap(NULL, PAGE_SIZE_4K, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return 0;
+    p[0] = 1;
+    int dirty = count_pagemap_bit(p, PAGE_SIZE_4K, 55) > 0;
+    munmap(p, PAGE_SIZE_4K);
+    return dirty;
+}
+
+// Incremental checkpoints: clear soft-dirty, let the application write a
+// random share of its 4kB pages, then scan pagemap for the dirty ones. With
+// huge pages a single write marks the whole huge page dirty.
+int bench_soft_dirty(const BenchConfig *cfg) {
+    const ModeConfig *mc = &cfg->mode;
+    const double ladder[] = {0.001, 0.01, 0.1, 1.0};
+    const double *fractions = cfg->touch_fraction < 1.0 ? &cfg->touch_fraction : ladder;
+    int nfractions = cfg->touch_fraction < 1.0 ? 1 : 4;
+    size_t pages = cfg->size / PAGE_SIZE_4K;
+
+    printf("--- Soft-Dirty Tracking Benchmark ---\n");
+    printf("%zu MB of %s pages, writes at 4kB granularity\n", cfg->size >> 20, mc->name);
+    if (mc->huge_page_size) {
+        // clear_refs does not write-protect HugeTLB pages, and pagemap reports
+        // them soft-dirty only through the VMA flag, which the clear resets
+        printf("Skipped: Writes to HugeTLB pages are not tracked after a clear, so the\n");
+        printf("         dirty counts would be meaningless for %s. Use 4k or thp.\n", mc->name);
+        printf("--------------------------------------------------\n");
+        return 0;
+    }
+    int fd;
+    char *addr = map_region(cfg->size, mc, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+        return 1;
+    }
+    advise_region(addr, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+    size_t fault_offset;
+    touch_memory(addr, cfg->size, mc->touch_step_size, TOUCH_WRITE, &fault_offset);
+    if (fault_offset != SIZE_MAX) {
+        fprintf(stderr, "Error: SIGBUS while populating at offset %zu (pool too small?).\n", fault_offset);
+        unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+        return 1;
+    }
+
+    // A freshly written page is soft-dirty; after a clear none should be
+    long dirty = count_pagemap_bit(addr, cfg->size, 55);
+    if (dirty <= 0) {
+        fprintf(stderr, "Error: No soft-dirty pages after populating (kernel without CONFIG_MEM_SOFT_DIRTY?).\n");
+        unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+        return 1;
+    }
+    if (clear_soft_dirty() != 0) {
+        fprintf(stderr, "Error: Could not write /proc/self/clear_refs: %s\n", strerror(errno));
+        unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+        return 1;
+    }
+    dirty = count_pagemap_bit(addr, cfg->size, 55);
+    if (dirty > 0) {
+        printf("Warning: %ld of %zu pages are still soft-dirty after clear_refs; the\n", dirty, pages);
+        printf("         kernel does not track writes to this mapping.\n");
+    }
+
+    printf("%8s %11s %10s %10s %10s %8s %9s %10s %10s %7s\n", "Written", "Written(MB)", "Clear(ms)",
+           "Write(ms)", "Plain(ms)", "Faults", "us/fault", "Scan(ms)", "Dirty(MB)", "Ampl.");
+    int untracked = 0;
+    for (int i = 0; i < nfractions; i++) {
+        unsigned int seed = 42 + i;
+        // The same pages written without tracking: they are already writable
+        uint64_t start = now_ns();
+        size_t written = touch_fraction(addr, cfg->size, PAGE_SIZE_4K, fractions[i], seed);
+        uint64_t plain_ns = now_ns() - start;
+
+        start = now_ns();
+        clear_soft_dirty();
+        uint64_t clear_ns = now_ns() - start;
+
+        long minor_before, minor_after, major;
+        get_fault_counts(&minor_before, &major);
+        start = now_ns();
+        touch_fraction(addr, cfg->size, PAGE_SIZE_4K, fractions[i], seed);
+        uint64_t write_ns = now_ns() - start;
+        get_fault_counts(&minor_after, &major);
+        long faults = minor_after - minor_before;
+
+        start = now_ns();
+        dirty = count_pagemap_bit(addr, cfg->size, 55);
+        uint64_t scan_ns = now_ns() - start;
+
+        printf("%7.1f%% %11.1f %10.2f %10.2f %10.2f %8ld %9.2f %10.2f %10.1f %6.1fx\n", fractions[i] * 100,
+               written * PAGE_SIZE_4K / 1048576.0, clear_ns / 1e6, write_ns / 1e6, plain_ns / 1e6, faults,
+               faults > 0 ? ((double)write_ns - plain_ns) / 1000.0 / faults : 0.0, scan_ns / 1e6,
+               dirty * PAGE_SIZE_4K / 1048576.0, written > 0 ? (double)dirty / written : 0.0);
+        if (written > 0 && dirty == 0) untracked = 1;
+    }
+    unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+    if (untracked) {
+        printf("Warning: Writes left no soft-dirty pages: writes to this mapping are not\n");
+        printf("         tracked after a clear, so the Dirty and Ampl. columns are meaningless.\n");
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Clear writes 4 to /proc/self/clear_refs, which write-protects every\n");
+    printf("      page. Write is the tracked pass, Plain the same writes without a clear;\n");
+    printf("      us/fault is their difference per write-protect fault. Scan reads bit 55\n");
+    printf("      of /proc/self/pagemap. Ampl. is dirty over written data: what an\n");
+    printf("      incremental checkpoint copies per byte the application changed.\n");
+    printf("--------------------------------------------------\n");
+    return 0;
+}
+
+// Classifying a big, sparsely populated mapping: read() of one pagemap
+// entry per 4kB page against PAGEMAP_SCAN, which skips unpopulated ranges
+// and merges populated ones
+int bench_pagemap_scan(const BenchConfig *cfg) {
+    const ModeConfig *mc = &cfg->mode;
+    printf("--- Pagemap Scan Benchmark ---\n");
+    printf("%zu MB of %s pages, %.3g%% populated\n", cfg->size >> 20, mc->name, cfg->touch_fraction * 100);
+    int fd;
+    char *addr = map_region(cfg->size, mc, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+        if (errno == ENOMEM && !(cfg->extra_flags & MAP_NORESERVE)) {
+            fprintf(stderr, "  Hint: Use --noreserve with --touch-fraction to scan a range larger than memory.\n");
+        }
+        return 1;
+    }
+    advise_region(addr, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+    uint64_t start = now_ns();
+    size_t touched = touch_fraction(addr, cfg->size, mc->touch_step_size, cfg->touch_fraction, 1);
+    printf("Populated %zu strides in %.2f ms\n", touched, (now_ns() - start) / 1e6);
+
+    printf("%-14s %12s %10s %10s %10s %12s %12s\n", "Method", "Time(ms)", "GB/s", "Calls", "Regions",
+           "Present(MB)", "Huge(MB)");
+    PageClasses read_pc, scan_pc;
+    int rc = 0;
+    for (int via_ioctl = 0; via_ioctl <= 1; via_ioctl++) {
+        PageClasses *pc = via_ioctl ? &scan_pc : &read_pc;
+        start = now_ns();
+        int ret = via_ioctl ? pagemap_scan_classify(addr, cfg->size, pc) : pagemap_read_classify(addr, cfg->size, pc);
+        uint64_t elapsed = now_ns() - start;
+        if (ret != 0) {
+            if (via_ioctl && (errno == ENOTTY || errno == EINVAL)) {
+                printf("%-14s not supported by this kernel (needs Linux 6.7+)\n", "PAGEMAP_SCAN");
+            } else {
+                fprintf(stderr, "Error: Scanning pagemap failed: %s\n", strerror(errno));
+                rc = 1;
+            }
+            break;
+        }
+        char regions[24] = "-";
+        if (via_ioctl) snprintf(regions, sizeof(regions), "%ld", pc->regions);
+        printf("%-14s %12.2f %10.1f %10ld %10s %12.1f %12.1f\n", via_ioctl ? "PAGEMAP_SCAN" : "pagemap read",
+               elapsed / 1e6, elapsed > 0 ? (double)cfg->size / elapsed : 0.0, pc->calls,
+               regions, pc->present / 256.0, pc->huge / 256.0);
+        if (via_ioctl) {
+            if (pc->present != read_pc.present || pc->huge != read_pc.huge) {
+                printf("Warning: The two scans disagree (pages changed in between?).\n");
+            }
+        }
+    }
+    unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+    printf("--------------------------------------------------\n");
+    printf("NOTE: GB/s is virtual address range per second. pagemap read issues one\n");
+    printf("      pread per 32kB of entries (4096 pages) and takes huge pages from\n");
+    printf("      smaps; PAGEMAP_SCAN returns up to 1024 present ranges per ioctl.\n");
+    printf("--------------------------------------------------\n");
+    return rc;
+}
+
+// How the accessed working set of a mapping is measured
+typedef enum {
+    WSS_PAGE_IDLE,  // /sys/kernel/mm/page_idle/bitmap, per physical page (root)
+    WSS_REFERENCED  // clear_refs (1) and the Referenced field of smaps
+} WssMethod;
+
+// Physical frame numbers of the present 4kB pages of a mapping (root only).
+// Returns the number found, or -1 if pagemap hides them.
+long collect_pfns(void *addr, size_t size, uint64_t *pfns) {
+    int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    uint64_t entries[512];
+    size_t first = (uintptr_t)addr / PAGE_SIZE_4K;
+    size_t pages = size / PAGE_SIZE_4K;
+    long found = 0;
+    for (size_t done = 0; done < pages; ) {
+        size_t batch = pages - done < 512 ? pages - done : 512;
+        ssize_t n = pread(fd, entries, batch * sizeof(uint64_t), (off_t)((first + done) * sizeof(uint64_t)));
+        if (n <= 0) break;
+        for (size_t i = 0; i < (size_t)n / sizeof(uint64_t); i++) {
+            uint64_t pfn = entries[i] & ((1ULL << 55) - 1);
+            if ((entries[i] >> 63) && pfn) pfns[found++] = pfn;
+        }
+        done += (size_t)n / sizeof(uint64_t);
+    }
+    close(fd);
+    return found > 0 ? found : -1;
+}
+
+// Set the idle flag of the given frames (mark), or count those whose flag was
+// cleared by an access since. The bitmap holds one bit per PFN in 8-byte words;
+// consecutive frames of the same word are combined into one access.
+long page_idle_pass(int fd, const uint64_t *pfns, long count, int mark) {
+    long accessed = 0;
+    for (long i = 0; i < count; ) {
+        uint64_t word = pfns[i] / 64, bits = 0;
+        long j = i;
+        for (; j < count && pfns[j] / 64 == word; j++) bits |= 1ULL << (pfns[j] % 64);
+        off_t off = (off_t)(word * sizeof(uint64_t));
+        if (mark) {
+            if (pwrite(fd, &bits, sizeof(bits), off) != sizeof(bits)) return -1;
+        } else {
+            uint64_t idle;
+            if (pread(fd, &idle, sizeof(idle), off) != sizeof(idle)) return -1;
+            for (long k = i; k < j; k++) {
+                if (!((idle >> (pfns[k] % 64)) & 1)) accessed++;
+            }
+        }
+        i = j;
+    }
+    return accessed;
+}
+
+// Working-set estimation: mark the mapping idle, access a share of its 4kB
+// pages, and count what the kernel reports as accessed. Tracking works on
+// whole folios and page table entries, so huge pages inflate the estimate.
+int bench_wss(const BenchConfig *cfg) {
+    const ModeConfig *mc = &cfg->mode;
+    const double ladder[] = {0.001, 0.01, 0.1};
+    const double *fractions = cfg->touch_fraction < 1.0 ? &cfg->touch_fraction : ladder;
+    int nfractions = cfg->touch_fraction < 1.0 ? 1 : 3;
+    size_t pages = cfg->size / PAGE_SIZE_4K;
+
+    printf("--- Working Set Estimation Benchmark ---\n");
+    printf("%zu MB of %s pages, accesses at 4kB granularity\n", cfg->size >> 20, mc->name);
+    int fd;
+    char *addr = map_region(cfg->size, mc, BACKING_PRIVATE, cfg->extra_flags, NULL, &fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+        return 1;
+    }
+    advise_region(addr, cfg->size, mc, BACKING_PRIVATE, cfg->thp_status);
+    size_t fault_offset;
+    touch_memory(addr, cfg->size, mc->touch_step_size, TOUCH_WRITE, &fault_offset);
+    if (fault_offset != SIZE_MAX) {
+        fprintf(stderr, "Error: SIGBUS while populating at offset %zu (pool too small?).\n", fault_offset);
+        unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+        return 1;
+    }
+
+    WssMethod method = WSS_REFERENCED;
+    uint64_t *pfns = NULL;
+    long npfns = 0;
+    int idle_fd = open("/sys/kernel/mm/page_idle/bitmap", O_RDWR | O_CLOEXEC);
+    if (idle_fd >= 0) {
+        pfns = malloc(pages * sizeof(uint64_t));
+        npfns = pfns ? collect_pfns(addr, cfg->size, pfns) : -1;
+        if (npfns > 0) {
+            method = WSS_PAGE_IDLE;
+        } else {
+            printf("Warning: pagemap shows no PFNs (needs CAP_SYS_ADMIN); using smaps Referenced.\n");
+        }
+    } else {
+        printf("Warning: %s: %s; using clear_refs and smaps Referenced.\n", "/sys/kernel/mm/page_idle/bitmap",
+               errno == ENOENT ? "not available (kernel without CONFIG_IDLE_PAGE_TRACKING)" : strerror(errno));
+    }
+    printf("Method: %s\n", method == WSS_PAGE_IDLE ? "page_idle bitmap (per physical page)"
+                                                   : "clear_refs + smaps Referenced (per page table entry)");
+
+    printf("%-10s %8s %12s %12s %9s %10s %10s\n", "Layout", "Share", "Accessed(MB)", "Apparent(MB)",
+           "Inflation", "Mark(ms)", "Read(ms)");
+    int rc = 0, untracked = 0;
+    for (int i = 0; i < nfractions && rc == 0; i++) {
+        for (int scattered = 0; scattered <= 1 && rc == 0; scattered++) {
+            uint64_t start = now_ns();
+            long marked = method == WSS_PAGE_IDLE ? page_idle_pass(idle_fd, pfns, npfns, 1)
+                                                  : write_str_file("/proc/self/clear_refs", "1");
+            uint64_t mark_ns = now_ns() - start;
+
+            // The workload: one hot block at the start, or pages spread at random
+            size_t accessed;
+            if (scattered) {
+                accessed = touch_fraction(addr, cfg->size, PAGE_SIZE_4K, fractions[i], 7 + i);
+            } else {
+                size_t len = (size_t)(pages * fractions[i]) * PAGE_SIZE_4K;
+                accessed = touch_memory(addr, len, PAGE_SIZE_4K, TOUCH_WRITE, &fault_offset);
+            }
+
+            start = now_ns();
+            long apparent = -1;
+            if (method == WSS_PAGE_IDLE) {
+                apparent = page_idle_pass(idle_fd, pfns, npfns, 0);
+            } else {
+                long kb = get_smaps_range_kb(addr, cfg->size, "Referenced");
+                if (kb >= 0) apparent = kb / 4;
+            }
+            uint64_t read_ns = now_ns() - start;
+            if (marked < 0 || apparent < 0) {
+                fprintf(stderr, "Error: Idle tracking failed: %s\n", strerror(errno));
+                rc = 1;
+                break;
+            }
+            printf("%-10s %7.1f%% %12.1f %12.1f %8.1fx %10.2f %10.2f\n", scattered ? "scattered" : "contiguous",
+                   fractions[i] * 100, accessed / 256.0, apparent / 256.0,
+                   accessed > 0 ? (double)apparent / accessed : 0.0, mark_ns / 1e6, read_ns / 1e6);
+            if (accessed > 0 && apparent == 0) untracked = 1;
+        }
+    }
+    if (untracked) {
+        printf("Warning: Accesses left no trace; the kernel does not track this mapping.\n");
+    }
+    if (idle_fd >= 0) close(idle_fd);
+    free(pfns);
+    unmap_region(addr, cfg->size, BACKING_PRIVATE, fd);
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Accessed is what the workload touched, Apparent what the kernel\n");
+    printf("      reports; Inflation is their ratio. One access marks a whole THP as\n");
+    printf("      used. HugeTLB pages are not on the LRU: page_idle cannot track them,\n");
+    printf("      and smaps has no Referenced count for them.\n");
+    printf("--------------------------------------------------\n");
+    return rc;
+}
+
+// Who resolves the faults of a userfaultfd round
+typedef enum {
+    RESOLVE_KERNEL,   // No userfaultfd: the kernel's own fault handler
+    RESOLVE_COPY,     // UFFDIO_COPY from a snapshot buffer (missing faults)
+    RESOLVE_ZEROPAGE, // UFFDIO_ZEROPAGE (missing faults, not HugeTLB)
+    RESOLVE_CONTINUE  // UFFDIO_CONTINUE of a page already in a memfd's page cache (minor faults)
+} UffdResolve;
+
+// A fault-handling thread; all handlers of a round read the same userfaultfd
+typedef struct {
+    int uffd;
+    int stop_fd;        // Read end of a pipe that becomes readable when the round is over
+    UffdResolve resolve;
+    char *base;         // Registered mapping
+    const char *source; // Snapshot data for UFFDIO_COPY, same layout as base
+    size_t granule;     // Bytes resolved per fault: 4kB, or the HugeTLB page size
+    long resolved;
+    long errors;
+} UffdHandler;
+
+void *uffd_handler(void *arg) {
+    UffdHandler *h = arg;
+    struct pollfd fds[2] = {{h->uffd, POLLIN, 0}, {h->stop_fd, POLLIN, 0}};
+    for (;;) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+        if (fds[1].revents) break;
+        struct uffd_msg msg;
+        if (read(h->uffd, &msg, sizeof(msg)) != sizeof(msg)) continue; // Another handler got it
+        if (msg.event != UFFD_EVENT_PAGEFAULT) continue;
+        uint64_t addr = msg.arg.pagefault.address & ~(uint64_t)(h->granule - 1);
+        int rc;
+        do {
+            if (h->resolve == RESOLVE_COPY) {
+                struct uffdio_copy copy = {addr, (uintptr_t)(h->source + (addr - (uintptr_t)h->base)),
+                                           h->granule, 0, 0};
+                rc = ioctl(h->uffd, UFFDIO_COPY, &copy);
+            } else if (h->resolve == RESOLVE_ZEROPAGE) {
+                struct uffdio_zeropage zero = {{addr, h->granule}, 0, 0};
+                rc = ioctl(h->uffd, UFFDIO_ZEROPAGE, &zero);
+            } else {
+                struct uffdio_continue cont = {{addr, h->granule}, 0, 0};
+                rc = ioctl(h->uffd, UFFDIO_CONTINUE, &cont);
+            }
+        } while (rc != 0 && errno == EAGAIN);
+        if (rc == 0 || errno == EEXIST) h->resolved++;
+        else h->errors++;
+    }
+    return NULL;
+}
+
+// Open a userfaultfd and register [addr, addr + size) for missing or minor
+// faults. Returns the fd, or -1 (-2 if the resolve ioctl isn't available for
+// this kind of mapping).
+int open_uffd(void *addr, size_t size, UffdResolve resolve) {
+    int uffd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    if (uffd < 0 && errno == EINVAL) uffd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        fprintf(stderr, "Error: userfaultfd failed: %s\n", strerror(errno));
+        if (errno == EPERM) {
+            fprintf(stderr, "  Hint: Set vm.unprivileged_userfaultfd=1 or run with CAP_SYS_PTRACE.\n");
+        }
+        return -1;
+    }
+    struct uffdio_api api = {UFFD_API, 0, 0};
+    struct uffdio_register reg = {{(uintptr_t)addr, size},
+                                  resolve == RESOLVE_CONTINUE ? UFFDIO_REGISTER_MODE_MINOR
+                                                              : UFFDIO_REGISTER_MODE_MISSING, 0};
+    if (ioctl(uffd, UFFDIO_API, &api) != 0 || ioctl(uffd, UFFDIO_REGISTER, &reg) != 0) {
+        int unsupported = errno == EINVAL;
+        if (!unsupported) fprintf(stderr, "Error: Registering with userfaultfd failed: %s\n", strerror(errno));
+        close(uffd);
+        return unsupported ? -2 : -1;
+    }
+    int bit = resolve == RESOLVE_COPY ? _UFFDIO_COPY : resolve == RESOLVE_ZEROPAGE ? _UFFDIO_ZEROPAGE
+                                                                                   : _UFFDIO_CONTINUE;
+    if (!(reg.ioctls & (1ULL << bit))) {
+        close(uffd);
+        return -2;
+    }
+    return uffd;
+}
+
+// Fault <size> in with n threads, each in its own slice, and let n handler
+// threads resolve the faults through userfaultfd (or the kernel, for the
+// baseline). Prints one table row.
+int run_uffd_round(const BenchConfig *cfg, int n, UffdResolve resolve) {
+    const ModeConfig *mc = &cfg->mode;
+    const char *names[] = {"kernel", "UFFDIO_COPY", "UFFDIO_ZEROPAGE", "UFFDIO_CONTINUE"};
+    size_t step = mc->touch_step_size;
+    size_t slice = cfg->size / (size_t)n / step * step;
+    if (slice == 0) {
+        fprintf(stderr, "Error: <size> is too small for %d threads.\n", n);
+        return 1;
+    }
+    size_t total = slice / step * (size_t)n;
+
+    // MINOR faults need the page in the page cache already: fill a memfd
+    // through one mapping and fault it in through a second one
+    int fd = -1;
+    char *src = NULL, *addr;
+    Backing backing = resolve == RESOLVE_CONTINUE ? BACKING_MEMFD : BACKING_PRIVATE;
+    addr = map_region(cfg->size, mc, backing, cfg->extra_flags, NULL, &fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap failed: %s\n", strerror(errno));
+        return 1;
+    }
+    if (resolve == RESOLVE_CONTINUE) {
+        src = addr;
+        advise_region(src, cfg->size, mc, backing, cfg->thp_status);
+        size_t fault_offset;
+        touch_memory(src, cfg->size, step, TOUCH_WRITE, &fault_offset);
+        addr = mmap(NULL, cfg->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED || fault_offset != SIZE_MAX) {
+            fprintf(stderr, "Error: Could not prepare the memfd page cache.\n");
+            if (addr != MAP_FAILED) munmap(addr, cfg->size);
+            unmap_region(src, cfg->size, backing, fd);
+            return 1;
+        }
+    } else if (resolve == RESOLVE_COPY) {
+        // The snapshot to restore from, in ordinary memory
+        src = mmap(NULL, cfg->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (src == MAP_FAILED) {
+            fprintf(stderr, "Error: Could not allocate the snapshot buffer: %s\n", strerror(errno));
+            unmap_region(addr, cfg->size, backing, fd);
+            return 1;
+        }
+        size_t fault_offset;
+        touch_memory(src, cfg->size, PAGE_SIZE_4K, TOUCH_WRITE, &fault_offset);
+    }
+    advise_region(addr, cfg->size, mc, backing, cfg->thp_status);
+
+    int uffd = -1, stop_pipe[2] = {-1, -1};
+    int rc = 0, handlers_started = 0;
+    UffdHandler *handlers = calloc((size_t)n, sizeof(UffdHandler));
+    pthread_t *handler_tids = calloc((size_t)n, sizeof(pthread_t));
+    FaultWorker *workers = calloc((size_t)n, sizeof(FaultWorker));
+    pthread_t *tids = calloc((size_t)n, sizeof(pthread_t));
+    uint64_t *latency = malloc(total * sizeof(uint64_t));
+    if (!handlers || !handler_tids || !workers || !tids || !latency) rc = 1;
+    if (rc == 0 && resolve != RESOLVE_KERNEL) {
+        uffd = open_uffd(addr, cfg->size, resolve);
+        if (uffd == -2) {
+            printf("%-16s %7d  not supported for this mapping\n", names[resolve], n);
+            rc = -1;
+        } else if (uffd < 0 || pipe(stop_pipe) != 0) {
+            rc = 1;
+        }
+    }
+    for (; rc == 0 && resolve != RESOLVE_KERNEL && handlers_started < n; handlers_started++) {
+        UffdHandler *h = &handlers[handlers_started];
+        h->uffd = uffd;
+        h->stop_fd = stop_pipe[0];
+        h->resolve = resolve;
+        h->base = addr;
+        h->source = src;
+        h->granule = mc->huge_page_size ? mc->huge_page_size : PAGE_SIZE_4K;
+        if (pthread_create(&handler_tids[handlers_started], NULL, uffd_handler, h) != 0) {
+            fprintf(stderr, "Error: pthread_create failed.\n");
+            rc = 1;
+            break;
+        }
+    }
+
+    int go = 0, started = 0;
+    long minor_before, minor_after, major;
+    get_fault_counts(&minor_before, &major);
+    for (; rc == 0 && started < n; started++) {
+        FaultWorker *w = &workers[started];
+        w->addr = addr + (size_t)started * slice;
+        w->len = slice;
+        w->step = step;
+        w->go = &go;
+        w->latency_ns = latency + (size_t)started * (slice / step);
+        if (pthread_create(&tids[started], NULL, fault_worker, w) != 0) {
+            fprintf(stderr, "Error: pthread_create failed.\n");
+            rc = 1;
+            break;
+        }
+    }
+    uint64_t start = now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE); // On error too, so started threads finish
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    uint64_t elapsed = now_ns() - start;
+    get_fault_counts(&minor_after, &major);
+    if (handlers_started > 0 && write(stop_pipe[1], "x", 1) != 1) {
+        rc = 1; // Handlers would never return; leave them blocked rather than hang
+    } else {
+        for (int t = 0; t < handlers_started; t++) pthread_join(handler_tids[t], NULL);
+    }
+
+    if (rc == 0) {
+        long resolved = 0, errors = 0;
+        for (int t = 0; t < handlers_started; t++) {
+            resolved += handlers[t].resolved;
+            errors += handlers[t].errors;
+        }
+        const char *huge_key = mc->huge_page_size ? (backing == BACKING_MEMFD ? "Shared_Hugetlb" : "Private_Hugetlb")
+                                                  : (backing == BACKING_MEMFD ? "ShmemPmdMapped" : "AnonHugePages");
+        qsort(latency, total, sizeof(uint64_t), compare_u64);
+        printf("%-16s %7d %10.2f %8.2f %10ld %10.2f %10.2f %10ld\n", names[resolve], n, elapsed / 1e6,
+               (double)cfg->size / elapsed, resolve == RESOLVE_KERNEL ? minor_after - minor_before : resolved,
+               latency[total / 2] / 1000.0, latency[total * 99 / 100] / 1000.0, get_smaps_kb(addr, huge_key));
+        if (errors > 0) printf("Warning: %ld faults could not be resolved.\n", errors);
+    }
+    if (uffd >= 0) close(uffd);
+    if (stop_pipe[0] >= 0) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+    }
+    if (resolve == RESOLVE_CONTINUE) {
+        munmap(addr, cfg->size);
+        unmap_region(src, cfg->size, backing, fd);
+    } else {
+        unmap_region(addr, cfg->size, backing, fd);
+        if (src) munmap(src, cfg->size);
+    }
+    free(handlers);
+    free(handler_tids);
+    free(workers);
+    free(tids);
+    free(latency);
+    return rc > 0 ? rc : 0;
+}
+
+// Lazy restore of a snapshotted pool: faults are resolved by userfaultfd
+// handler threads instead of the kernel. Compare the resolve ioctls with the
+// kernel-handled touch loop for 1..--threads faulting and handler threads.
+int bench_uffd(const BenchConfig *cfg) {
+    printf("--- userfaultfd Population Benchmark ---\n");
+    printf("%zu MB of %s pages, 1..%d faulting threads with as many handler threads\n",
+           cfg->size >> 20, cfg->mode.name, cfg->threads);
+    printf("%-16s %7s %10s %8s %10s %10s %10s %10s\n", "Resolved by", "Threads", "Time(ms)", "GB/s",
+           "Faults", "p50(us)", "p99(us)", "Huge(kB)");
+    int rc = 0;
+    for (int n = 1; n > 0 && rc == 0; n = next_proc_count(n, cfg->threads)) {
+        for (UffdResolve r = RESOLVE_KERNEL; r <= RESOLVE_CONTINUE && rc == 0; r++) {
+            rc = run_uffd_round(cfg, n, r);
+        }
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: Faults are minor faults for the kernel rows and resolved userfaults\n");
+    printf("      otherwise. Latency is per touched stride. userfaultfd resolves 4kB at\n");
+    printf("      a time except for HugeTLB, so thp gets no huge pages; ZEROPAGE maps the\n");
+    printf("      zero page and the write then faults again for a copy. CONTINUE maps a\n");
+    printf("      page already in a memfd's page cache.\n");
+    printf("--------------------------------------------------\n");
+    return rc;
+}
+
+// Scenarios selectable with --bench
+typedef struct {
+    const char *name;
+    int (*run)(const BenchConfig *cfg);
+    const char *help;
+} BenchEntry;
+
+const BenchEntry bench_table[] = {
+    {"shared-pool", bench_shared_pool, "MAP_SHARED pool touched by 1..--procs processes"},
+    {"pmd-share",   bench_pmd_share, "hugetlb file mapped by 1..--procs processes (2m only)"},
+    {"fault-around", bench_fault_around, "--file scanned with each madvise hint, cold and warm cache"},
+    {"direct-io",   bench_direct_io, "O_DIRECT preads of --file into a buffer of the mode, 1..--threads"},
+    {"io-uring",    bench_io_uring, "io_uring buffer registration time, fixed vs plain O_DIRECT reads"},
+    {"ring",        bench_ring, "1..--rings memfds of <size>, each mapped twice as a wrap-free ring"},
+    {"itlb",        bench_itlb, "JIT-generated functions on <size> of code, random calls, iTLB misses"},
+    {"thread-stacks", bench_thread_stacks, "1..--threads threads with <size> stacks of the mode"},
+    {"vma-count",   bench_vma_count, "--mappings separate <size> mappings: mmap, fault, munmap, slab cost"},
+    {"vma-lock",    bench_vma_lock, "1..--threads faulting into one VMA vs own VMAs, with mmap churn"},
+    {"churn",       bench_churn, "1..--threads map/touch/unmap or DONTNEED <size> allocations"},
+    {"mremap-grow", bench_mremap_grow, "Grow a populated mapping by <size> per --steps with mremap"},
+    {"relocate",    bench_relocate, "--moves random pages between slots: memcpy vs mremap DONTUNMAP"},
+    {"mlock",       bench_mlock, "MAP_LOCKED, mlock, mlock2(ONFAULT), mlockall vs the touch loop"},
+    {"soft-dirty",  bench_soft_dirty, "Clear soft-dirty, write a share of the pages, scan pagemap"},
+    {"pagemap-scan", bench_pagemap_scan, "Classify <size> with pagemap read() vs the PAGEMAP_SCAN ioctl"},
+    {"wss",         bench_wss, "Mark <size> idle, access a share of its pages, report the working set"},
+    {"uffd",        bench_uffd, "Populate via userfaultfd COPY/ZEROPAGE/CONTINUE vs the kernel, 1..--threads"},
+    {NULL, NULL, NULL}
+};
+
+const BenchEntry *find_bench(const char *name) {
+    for (const BenchEntry *b = bench_table; b->name; b++) {
+        if (strcmp(b->name, name) == 0) return b;
+    }
+    return NULL;
+}
+
+// --- Main Logic ---
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <size[K|M|G]> <mode:4k|thp|2m|1g>\n", prog);
+    fprintf(stderr, "  size: Mapping size (e.g., 1G, 256M)\n");
+    fprintf(stderr, "  mode: Page size strategy\n");
+    fprintf(stderr, "    4k:  Attempt 4KB pages (using madvise hint)\n");
+    fprintf(stderr, "    thp: Standard anonymous mapping (allow Transparent Huge Pages)\n");
+    fprintf(stderr, "    2m:  Explicit 2MB HugeTLB pages (requires configuration)\n");
+    fprintf(stderr, "    1g:  Explicit 1GB HugeTLB pages (requires configuration)\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --preflight   Only check whether the HugeTLB pool can back the mapping, then exit\n");
+    fprintf(stderr, "                (exit status 0: will succeed, 2: may succeed, 3: will fail)\n");
+    fprintf(stderr, "  --provision[=NODE]\n");
+    fprintf(stderr, "                Grow nr_hugepages (globally or on NODE) to fit the mapping,\n");
+    fprintf(stderr, "                time the allocation and restore the original size at exit (root)\n");
+    fprintf(stderr, "  --noreserve   Add MAP_NORESERVE (HugeTLB: no reservation, SIGBUS if the pool runs dry)\n");
+    fprintf(stderr, "  --cgroup=DIR  Run the measurement in a new child cgroup under the delegated\n");
+    fprintf(stderr, "                cgroup v2 directory DIR and report its memory.stat\n");
+    fprintf(stderr, "  --memory-max=SIZE\n");
+    fprintf(stderr, "                Set memory.max of that cgroup (requires --cgroup)\n");
+    fprintf(stderr, "  --backing=private|shared|memfd|tmpfs|sysv|file\n");
+    fprintf(stderr, "                Memory source (default: anonymous private)\n");
+    fprintf(stderr, "  --bench=NAME  Run a benchmark scenario instead of the single mapping:\n");
+    for (const BenchEntry *b = bench_table; b->name; b++) {
+        fprintf(stderr, "                  %-14s %s\n", b->name, b->help);
+    }
+    fprintf(stderr, "  --procs=N     Maximum number of processes (default 4)\n");
+    fprintf(stderr, "  --touch-fraction=F\n");
+    fprintf(stderr, "                Share of the pages each process touches (0-1, default 1)\n");
+    fprintf(stderr, "  --file=PATH   File for --backing=tmpfs|file and file-backed scenarios\n");
+    fprintf(stderr, "  --prefill     Write out a newly created --file instead of leaving it sparse\n");
+    fprintf(stderr, "  --map-private Map the file MAP_PRIVATE (default MAP_SHARED)\n");
+    fprintf(stderr, "  --read-only   Open and map the file read-only; only read while touching\n");
+    fprintf(stderr, "  --pattern=seq|random\n");
+    fprintf(stderr, "                Page order of scanning benchmarks (default seq)\n");
+    fprintf(stderr, "  --threads=N   Maximum I/O queue depth: threads, or io_uring requests (default 4)\n");
+    fprintf(stderr, "  --block-size=SIZE\n");
+    fprintf(stderr, "                Bytes per I/O request or ring record (default 128K)\n");
+    fprintf(stderr, "  --rings=N     Maximum number of ring buffers (default 4)\n");
+    fprintf(stderr, "  --guard=SIZE  Guard below each thread stack (default 4K, 0 for none)\n");
+    fprintf(stderr, "  --touch-depth=SIZE\n");
+    fprintf(stderr, "                Bytes of each thread stack that are used (default 64K)\n");
+    fprintf(stderr, "  --mappings=K  Number of separate mappings (default: up to vm.max_map_count)\n");
+    fprintf(stderr, "  --guards      Follow each mapping with a PROT_NONE guard\n");
+    fprintf(stderr, "  --steps=N     Number of growth steps (default 8)\n");
+    fprintf(stderr, "  --moves=N     Number of page relocations (default 10000)\n");
+    fprintf(stderr, "  --fault-around-bytes=N\n");
+    fprintf(stderr, "                Set debugfs fault_around_bytes for the run and restore it after (root)\n");
+    fprintf(stderr, "\nExample: %s 1G 2m\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int preflight_only = 0;
+    int provision = 0;
+    int provision_node = -1;
+    int noreserve = 0;
+    const char *cgroup_parent = NULL;
+    size_t memory_max = 0;
+    Backing backing = BACKING_PRIVATE;
+    const BenchEntry *bench = NULL;
+    BenchConfig bench_cfg;
+    memset(&bench_cfg, 0, sizeof(bench_cfg));
+    bench_cfg.procs = 4;
+    bench_cfg.touch_fraction = 1.0;
+    bench_cfg.fault_around_bytes = -1;
+    bench_cfg.threads = 4;
+    bench_cfg.block_size = 128 * 1024;
+    bench_cfg.rings = 4;
+    bench_cfg.guard_size = PAGE_SIZE_4K;
+    bench_cfg.touch_depth = 64 * 1024;
+    bench_cfg.steps = 8;
+    bench_cfg.moves = 10000;
+
+    static const struct option long_options[] = {
+        {"preflight", no_argument, NULL, 'p'},
+        {"provision", optional_argument, NULL, 'P'},
+        {"noreserve", no_argument, NULL, 'N'},
+        {"cgroup",    required_argument, NULL, 'c'},
+        {"memory-max", required_argument, NULL, 'm'},
+        {"backing",   required_argument, NULL, 'b'},
+        {"bench",     required_argument, NULL, 'B'},
+        {"procs",     required_argument, NULL, 'n'},
+        {"touch-fraction", required_argument, NULL, 'f'},
+        {"file",      required_argument, NULL, 'F'},
+        {"prefill",   no_argument, NULL, 'R'},
+        {"map-private", no_argument, NULL, 'V'},
+        {"read-only", no_argument, NULL, 'O'},
+        {"pattern",   required_argument, NULL, 'A'},
+        {"fault-around-bytes", required_argument, NULL, 'a'},
+        {"threads",   required_argument, NULL, 't'},
+        {"block-size", required_argument, NULL, 'k'},
+        {"rings",     required_argument, NULL, 'r'},
+        {"guard",     required_argument, NULL, 'g'},
+        {"touch-depth", required_argument, NULL, 'd'},
+        {"mappings",  required_argument, NULL, 'K'},
+        {"guards",    no_argument, NULL, 'G'},
+        {"steps",     required_argument, NULL, 's'},
+        {"moves",     required_argument, NULL, 'M'},
+        {"help",      no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'p': preflight_only = 1; break;
+            case 'N': noreserve = 1; break;
+            case 'c': cgroup_parent = optarg; break;
+            case 'b':
+                if (parse_backing(optarg, &backing) != 0) {
+                    fprintf(stderr, "Error: Invalid backing '%s'. Use private, shared, memfd, tmpfs, sysv or file.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B':
+                bench = find_bench(optarg);
+                if (!bench) {
+                    fprintf(stderr, "Error: Unknown benchmark '%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'F': bench_cfg.file.path = optarg; break;
+            case 'R': bench_cfg.file.prefill = 1; break;
+            case 'V': bench_cfg.file.map_private = 1; break;
+            case 'O': bench_cfg.file.read_only = 1; break;
+            case 'A':
+                if (strcmp(optarg, "seq") == 0) bench_cfg.pattern = PATTERN_SEQ;
+                else if (strcmp(optarg, "random") == 0) bench_cfg.pattern = PATTERN_RANDOM;
+                else {
+                    fprintf(stderr, "Error: Invalid pattern '%s'. Use seq or random.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                bench_cfg.threads = atoi(optarg);
+                if (bench_cfg.threads < 1) {
+                    fprintf(stderr, "Error: --threads must be at least 1.\n");
+                    return 1;
+                }
+                break;
+            case 'k':
+                bench_cfg.block_size = parse_size(optarg);
+                if (bench_cfg.block_size == 0) return 1;
+                break;
+            case 'r':
+                bench_cfg.rings = atoi(optarg);
+                if (bench_cfg.rings < 1) {
+                    fprintf(stderr, "Error: --rings must be at least 1.\n");
+                    return 1;
+                }
+                break;
+            case 'g':
+                bench_cfg.guard_size = strcmp(optarg, "0") == 0 ? 0 : parse_size(optarg);
+                if (strcmp(optarg, "0") != 0 && bench_cfg.guard_size == 0) return 1;
+                if (bench_cfg.guard_size % PAGE_SIZE_4K != 0) {
+                    fprintf(stderr, "Error: --guard must be a multiple of 4kB.\n");
+                    return 1;
+                }
+                break;
+            case 'd':
+                bench_cfg.touch_depth = parse_size(optarg);
+                if (bench_cfg.touch_depth == 0) return 1;
+                break;
+            case 'K':
+                bench_cfg.mappings = atol(optarg);
+                if (bench_cfg.mappings < 1) {
+                    fprintf(stderr, "Error: --mappings must be at least 1.\n");
+                    return 1;
+                }
+                break;
+            case 'G': bench_cfg.guards = 1; break;
+            case 'M':
+                bench_cfg.moves = atol(optarg);
+                if (bench_cfg.moves < 1) {
+                    fprintf(stderr, "Error: --moves must be at least 1.\n");
+                    return 1;
+                }
+                break;
+            case 's':
+                bench_cfg.steps = atoi(optarg);
+                if (bench_cfg.steps < 1) {
+                    fprintf(stderr, "Error: --steps must be at least 1.\n");
+                    return 1;
+                }
+                break;
+            case 'a':
+                bench_cfg.fault_around_bytes = (long long)parse_size(optarg);
+                if (bench_cfg.fault_around_bytes == 0) return 1;
+                break;
+            case 'n':
+                bench_cfg.procs = atoi(optarg);
+                if (bench_cfg.procs < 1) {
+                    fprintf(stderr, "Error: --procs must be at least 1.\n");
+                    return 1;
+                }
+                break;
+            case 'f':
+                bench_cfg.touch_fraction = strtod(optarg, NULL);
+                if (bench_cfg.touch_fraction <= 0 || bench_cfg.touch_fraction > 1) {
+                    fprintf(stderr, "Error: --touch-fraction must be in (0, 1].\n");
+                    return 1;
+                }
+                break;
+            case 'm':
+                memory_max = parse_size(optarg);
+                if (memory_max == 0) return 1;
+                break;
+            case 'P':
+                provision = 1;
+                if (optarg) {
+                    char *end;
+                    provision_node = (int)strtol(optarg, &end, 10);
+                    if (end == optarg || *end != '\0' || provision_node < 0) {
+                        fprintf(stderr, "Error: Invalid NUMA node '%s' for --provision.\n", optarg);
+                        return 1;
+                    }
+                }
+                break;
+            case 'h': print_usage(argv[0]); return 0;
+            default: print_usage(argv[0]); return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char *size_arg = argv[optind];
+    const char *mode_arg = argv[optind + 1];
+
+    // --- Parse Arguments ---
+    size_t map_size = parse_size(size_arg);
+    if (map_size == 0) {
+        return 1; // Error message already printed
+    }
+
+    ModeConfig mc;
+    if (parse_mode(mode_arg, &mc) != 0) {
+        fprintf(stderr, "Error: Invalid mode '%s'. Use 4k, thp, 2m, or 1g.\n", mode_arg);
+        return 1;
+    }
+    printf("Mode: %s\n", mc.description);
+    PageSizeMode mode = mc.mode;
+    size_t huge_page_size = mc.huge_page_size; // Relevant for HugeTLB modes
+    size_t touch_step_size = mc.touch_step_size;
+    int extra_flags = 0;
+
+    if (backing != BACKING_PRIVATE) {
+        printf("Backing: %s\n", backing_name(backing));
+    }
+    if (noreserve) {
+        extra_flags |= MAP_NORESERVE;
+        printf("Using MAP_NORESERVE\n");
+    }
+
+    // --- Pre-mmap Checks ---
+    if ((mode == MODE_2M || mode == MODE_1G) && (map_size % huge_page_size != 0)) {
+        fprintf(stderr, "Error: Mapping size %zu bytes must be a multiple of the huge page size (%zu bytes) for mode %s.\n",
+                map_size, huge_page_size, mode_arg);
+        return 1;
+    }
+
+    if ((preflight_only || provision) && mode != MODE_2M && mode != MODE_1G) {
+        fprintf(stderr, "Error: --preflight and --provision only apply to HugeTLB modes (2m, 1g).\n");
+        return 1;
+    }
+    if (provision && provision_hugepool(map_size, huge_page_size, provision_node) != 0) {
+        return 1;
+    }
+    if (preflight_only) {
+        return hugetlb_preflight(map_size, huge_page_size);
+    }
+
+    // --- Move the measurement into its own cgroup ---
+    CgroupRun cgroup_run;
+    if (memory_max > 0 && !cgroup_parent) {
+        fprintf(stderr, "Error: --memory-max requires --cgroup.\n");
+        return 1;
+    }
+    if (cgroup_parent) {
+        if (cgroup_run_setup(cgroup_parent, memory_max, &cgroup_run) != 0) {
+            return 1;
+        }
+        fflush(stdout);
+        pid_t child = fork();
+        if (child < 0) {
+            perror("Error: fork failed");
+            rmdir(cgroup_run.dir);
+            return 1;
+        }
+        if (child > 0) {
+            // Parent only waits; a memory.max OOM kill must not take the pool rollback with it
+            return cgroup_run_finish(&cgroup_run, child);
+        }
+        disarm_hugepool_rollback();
+        if (cgroup_run_join(&cgroup_run) != 0) {
+            _exit(1);
+        }
+    }
+
+    int is_hugetlb = (mode == MODE_2M || mode == MODE_1G);
+    if (is_hugetlb) {
+        hugetlb_preflight(map_size, huge_page_size);
+    }
+
+    ThpStatus thp_status = check_thp_status();
+    int is_shmem = backing_is_shmem(backing) && !is_hugetlb;
+    if (is_shmem) {
+        report_shmem_thp_policy(&mc, backing, bench_cfg.file.path);
+    } else {
+        if ((mode == MODE_4K || mode == MODE_THP) && thp_status == THP_NEVER) {
+            printf("Warning: System THP is set to 'never'. Kernel will likely use 4KB pages.\n");
+        }
+        if (mode == MODE_THP && thp_status == THP_UNKNOWN) {
+            printf("Warning: Could not determine system THP status.\n");
+        }
+    }
+    if (backing == BACKING_TMPFS && (is_hugetlb || !bench_cfg.file.path)) {
+        fprintf(stderr, "Error: --backing=tmpfs needs --file on a tmpfs mount and mode 4k or thp.\n");
+        return 1;
+    }
+    int is_file = (backing == BACKING_FILE);
+    if (is_file && (is_hugetlb || !bench_cfg.file.path)) {
+        fprintf(stderr, "Error: --backing=file needs --file and mode 4k or thp.\n");
+        return 1;
+    }
+    if (is_file) {
+        printf("File: %s (%s, %s%s)\n", bench_cfg.file.path,
+               bench_cfg.file.map_private ? "MAP_PRIVATE" : "MAP_SHARED",
+               bench_cfg.file.read_only ? "read-only" : "read-write",
+               bench_cfg.file.prefill ? ", prefilled if created" : "");
+    }
+
+    // --- Benchmark scenarios replace the single mapping flow ---
+    if (bench) {
+        bench_cfg.size = map_size;
+        bench_cfg.mode = mc;
+        bench_cfg.backing = backing;
+        bench_cfg.extra_flags = extra_flags;
+        bench_cfg.thp_status = thp_status;
+        return bench->run(&bench_cfg);
+    }
+
+
+    // --- Get baseline VmPTE ---
+    long vmpte_before = get_vmpte_kb();
+    if (vmpte_before < 0) {
+        fprintf(stderr, "Error: Could not get initial VmPTE from /proc/self/status. Aborting.\n");
+        return 1;
+    }
+    printf("Initial VmPTE: %ld kB\n", vmpte_before);
+    printf("Mapping size: %zu bytes (%.2f MB / %.2f GB)\n",
+           map_size, (double)map_size / (1024*1024), (double)map_size / (1024*1024*1024));
+
+    CgroupMemSnapshot cg_before, cg_after;
+    if (cgroup_parent) {
+        cgroup_mem_snapshot(&cgroup_run, huge_page_size, &cg_before);
+    }
+
+    struct shm_info shm_before, shm_after;
+    if (backing == BACKING_SYSV && get_shm_info(&shm_before) != 0) {
+        memset(&shm_before, 0, sizeof(shm_before));
+    }
+    long file_pmd_before = is_file ? get_meminfo_kb("FilePmdMapped") : -1;
+    long file_huge_before = is_file ? get_meminfo_kb("FileHugePages") : -1;
+    long shmem_huge_before = is_shmem ? get_meminfo_kb("ShmemHugePages") : -1;
+    long shmem_pmd_before = is_shmem ? get_meminfo_kb("ShmemPmdMapped") : -1;
+
+    HugePoolCounts pool_before;
+    int track_pool = is_hugetlb && read_hugepool_counts(huge_page_size, -1, &pool_before) == 0;
+
+    // --- mmap the memory ---
+    printf("--- Mapping Memory ---\n");
+    errno = 0;
+    int region_fd;
+    void *addr = map_region(map_size, &mc, backing, extra_flags, &bench_cfg.file, &region_fd);
+
+    if (addr == MAP_FAILED) {
+        int err = errno; // Capture errno immediately
+        fprintf(stderr, "Error: %s failed: %s (errno %d)\n",
+                backing == BACKING_SYSV ? "shmget/shmat" : "mmap", strerror(err), err);
+        if (backing == BACKING_SYSV) {
+            if (err == EINVAL) {
+                fprintf(stderr, "  Hint: Size may exceed kernel.shmmax (%lld bytes)", read_ll_file("/proc/sys/kernel/shmmax"));
+                fprintf(stderr, "%s.\n", is_hugetlb ? " or not be a multiple of the huge page size" : "");
+            } else if (err == ENOSPC) {
+                fprintf(stderr, "  Hint: kernel.shmall (%lld pages) or kernel.shmmni reached.\n",
+                        read_ll_file("/proc/sys/kernel/shmall"));
+            } else if (err == EPERM && is_hugetlb) {
+                fprintf(stderr, "  Hint: SHM_HUGETLB needs CAP_IPC_LOCK or membership in vm.hugetlb_shm_group.\n");
+            }
+        }
+        if ((mode == MODE_2M || mode == MODE_1G)) {
+            if (err == ENOMEM) {
+                fprintf(stderr, "  Hint: This often means insufficient HugeTLB pages are configured.\n");
+                fprintf(stderr, "        Check/increase '/proc/sys/vm/nr_hugepages' (for default size)\n");
+                fprintf(stderr, "        or '/sys/kernel/mm/hugepages/hugepages-%zukB/nr_hugepages' (for specific size).\n", huge_page_size / 1024);
+                fprintf(stderr, "        Ensure enough contiguous memory is available.\n");
+            } else if (err == EINVAL) {
+                fprintf(stderr, "  Hint: Check if mapping size (%zu) is a multiple of huge page size (%zu),\n", map_size, huge_page_size);
+                fprintf(stderr, "        or if the system supports HugeTLB pages of this size.\n");
+                fprintf(stderr, "        Flags used: 0x%x\n", backing == BACKING_SYSV
+                        ? sysv_shmget_flags(&mc, extra_flags) : region_mmap_flags(&mc, backing, extra_flags, &bench_cfg.file));
+            }
+        }
+        return 1;
+    }
+    if (track_pool) {
+        print_hugepool_snapshot("After mmap:", huge_page_size, &pool_before);
+    }
+
+    // --- Apply madvise hints (after successful mmap) ---
+    advise_region(addr, map_size, &mc, backing, thp_status);
+
+    if (track_pool) {
+        print_hugepool_snapshot("After madvise:", huge_page_size, &pool_before);
+    }
+
+    // --- Touch the memory ---
+    printf("--- Touching Memory (1 byte per %zu KB page/stride) ---\n", touch_step_size / 1024);
+    TouchAccess access = TOUCH_WRITE;
+    if (is_file || backing == BACKING_TMPFS) {
+        // Never change the contents of a user's file
+        access = bench_cfg.file.read_only ? TOUCH_READ : TOUCH_REWRITE;
+    }
+    // Clear soft-dirty first, so that the classification below can tell which
+    // pages the touch loop wrote. clear_refs does not track HugeTLB pages.
+    const char *written_na = NULL;
+    if (is_hugetlb) written_na = "not tracked for HugeTLB";
+    else if (!soft_dirty_supported()) written_na = "kernel without CONFIG_MEM_SOFT_DIRTY";
+    else if (clear_soft_dirty() != 0) written_na = "cannot write /proc/self/clear_refs";
+    size_t fault_offset;
+    long minflt_before, majflt_before, minflt_after, majflt_after;
+    get_fault_counts(&minflt_before, &majflt_before);
+    uint64_t touch_start = now_ns();
+    size_t touched_count = touch_memory(addr, map_size, touch_step_size, access, &fault_offset);
+    uint64_t touch_ns = now_ns() - touch_start;
+    get_fault_counts(&minflt_after, &majflt_after);
+    long faults = (minflt_after - minflt_before) + (majflt_after - majflt_before);
+    printf("Touched %zu strides.\n", touched_count);
+    printf("Touch time: %.2f ms, %ld minor + %ld major faults (%.0f ns per fault)\n",
+           (double)touch_ns / 1e6, minflt_after - minflt_before, majflt_after - majflt_before,
+           faults > 0 ? (double)touch_ns / (double)faults : 0.0);
+    if (fault_offset != SIZE_MAX && !is_hugetlb) {
+        printf("SIGBUS at offset %zu (stride %zu of %zu): access beyond the end of the backing file.\n",
+               fault_offset, fault_offset / touch_step_size + 1, (map_size + touch_step_size - 1) / touch_step_size);
+    } else if (fault_offset != SIZE_MAX) {
+        printf("SIGBUS at offset %zu (stride %zu of %zu): no huge page available at fault time.\n",
+               fault_offset, fault_offset / touch_step_size + 1, (map_size + touch_step_size - 1) / touch_step_size);
+        if (noreserve) {
+            printf("  MAP_NORESERVE skipped the mmap-time reservation, so the shortage surfaced as a\n");
+            printf("  crash-type fault instead of an ENOMEM from mmap.\n");
+        } else {
+            printf("  The pages were reserved, so this is most likely a hugetlb cgroup limit.\n");
+        }
+    }
+    if (track_pool) {
+        print_hugepool_snapshot("After touching:", huge_page_size, &pool_before);
+        printf("NOTE: MAP_HUGETLB reserves pages at mmap time (Rsvd rises, Free stays) and\n");
+        printf("      consumes them at fault time (Free and Rsvd drop together).\n");
+        if (noreserve) {
+            printf("      With MAP_NORESERVE nothing is reserved; a fault fails with SIGBUS\n");
+            printf("      if another process took the free pages in the meantime.\n");
+        }
+    }
+
+    if (cgroup_parent) {
+        cgroup_mem_snapshot(&cgroup_run, huge_page_size, &cg_after);
+    }
+    if (backing == BACKING_SYSV && get_shm_info(&shm_after) == 0) {
+        long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+        printf("--- SysV Shared Memory (shmctl SHM_INFO, system-wide) ---\n");
+        printf("shm_tot: %lu -> %lu pages (change %+ld kB)\n", shm_before.shm_tot, shm_after.shm_tot,
+               (long)(shm_after.shm_tot - shm_before.shm_tot) * page_kb);
+        printf("shm_rss: %lu -> %lu pages (change %+ld kB)\n", shm_before.shm_rss, shm_after.shm_rss,
+               (long)(shm_after.shm_rss - shm_before.shm_rss) * page_kb);
+        printf("shm_swp: %lu -> %lu pages (change %+ld kB)\n", shm_before.shm_swp, shm_after.shm_swp,
+               (long)(shm_after.shm_swp - shm_before.shm_swp) * page_kb);
+        if (is_hugetlb) {
+            printf("NOTE: For SHM_HUGETLB segments shm_rss is derived from huge page counts;\n");
+            printf("      some kernels scale it twice by the pages per huge page (compare shm_tot).\n");
+        }
+    }
+    if (is_file) {
+        printf("--- File Mapping Usage ---\n");
+        printf("Rss (this mapping):            %ld kB\n", get_smaps_kb(addr, "Rss"));
+        if (bench_cfg.file.map_private && !bench_cfg.file.read_only) {
+            printf("Anonymous (COW copies):        %ld kB\n", get_smaps_kb(addr, "Anonymous"));
+        }
+        printf("FilePmdMapped (this mapping):  %ld kB\n", get_smaps_kb(addr, "FilePmdMapped"));
+        if (mode == MODE_THP) {
+            // READ_ONLY_THP_FOR_FS: a clean file that is not open for writing can
+            // be collapsed into huge pages in the page cache (khugepaged or MADV_COLLAPSE)
+            uint64_t collapse_start = now_ns();
+            int collapse_rc = madvise(addr, map_size, MADV_COLLAPSE);
+            int err = errno;
+            if (collapse_rc == 0) {
+                printf("MADV_COLLAPSE: succeeded in %.2f ms\n", (double)(now_ns() - collapse_start) / 1e6);
+            } else {
+                const char *hint = "";
+                if (err == EINVAL) {
+                    hint = bench_cfg.file.read_only
+                           ? " (kernel without CONFIG_READ_ONLY_THP_FOR_FS or MADV_COLLAPSE)"
+                           : " (regular files can only be collapsed with --read-only)";
+                }
+                printf("MADV_COLLAPSE: failed: %s%s\n", strerror(err), hint);
+            }
+            printf("FilePmdMapped after collapse:  %ld kB\n", get_smaps_kb(addr, "FilePmdMapped"));
+        }
+        long file_pmd_after = get_meminfo_kb("FilePmdMapped");
+        long file_huge_after = get_meminfo_kb("FileHugePages");
+        if (file_pmd_before >= 0 && file_pmd_after >= 0) {
+            printf("FilePmdMapped (system):        %ld kB -> %ld kB (change %+ld kB)\n",
+                   file_pmd_before, file_pmd_after, file_pmd_after - file_pmd_before);
+        }
+        if (file_huge_before >= 0 && file_huge_after >= 0) {
+            printf("FileHugePages (system):        %ld kB -> %ld kB (change %+ld kB)\n",
+                   file_huge_before, file_huge_after, file_huge_after - file_huge_before);
+        }
+    }
+    if (is_shmem) {
+        long vma_pmd = get_smaps_kb(addr, "ShmemPmdMapped");
+        long shmem_huge_after = get_meminfo_kb("ShmemHugePages");
+        long shmem_pmd_after = get_meminfo_kb("ShmemPmdMapped");
+        printf("--- Shmem THP Usage ---\n");
+        if (vma_pmd >= 0) {
+            printf("ShmemPmdMapped (this mapping): %ld kB of %zu kB (%.1f%%)\n",
+                   vma_pmd, map_size / 1024, 100.0 * (double)vma_pmd * 1024 / (double)map_size);
+        }
+        if (shmem_huge_before >= 0 && shmem_huge_after >= 0) {
+            printf("ShmemHugePages (system):       %ld kB -> %ld kB (change %+ld kB)\n",
+                   shmem_huge_before, shmem_huge_after, shmem_huge_after - shmem_huge_before);
+        }
+        if (shmem_pmd_before >= 0 && shmem_pmd_after >= 0) {
+            printf("ShmemPmdMapped (system):       %ld kB -> %ld kB (change %+ld kB)\n",
+                   shmem_pmd_before, shmem_pmd_after, shmem_pmd_after - shmem_pmd_before);
+        }
+    }
+
+    // --- Classify the touched pages ---
+    PageClasses classes;
+    uint64_t classify_start = now_ns();
+    if (classify_pages(addr, map_size, &classes) == 0) {
+        uint64_t classify_ns = now_ns() - classify_start;
+        printf("--- Page Classification (%s) ---\n", classes.via_ioctl ? "PAGEMAP_SCAN" : "pagemap read");
+        printf("Present:      %ld kB of %zu kB\n", classes.present * 4, map_size / 1024);
+        printf("Huge-mapped:  %ld kB\n", classes.huge * 4);
+        if (written_na) printf("Written:      n/a (%s)\n", written_na);
+        else printf("Written:      %ld kB\n", classes.written * 4);
+        printf("Scan time:    %.2f ms", classify_ns / 1e6);
+        if (classes.via_ioctl) printf(" (%ld regions)", classes.regions);
+        printf("\n");
+    }
+
+    // --- Get VmPTE after mapping and touching ---
+    long vmpte_after = get_vmpte_kb();
+    if (vmpte_after < 0) {
+        fprintf(stderr, "Warning: Could not get final VmPTE. Change calculation skipped.\n");
+    } else {
+        printf("Final VmPTE:   %ld kB\n", vmpte_after);
+        long vmpte_diff = vmpte_after - vmpte_before;
+        printf("VmPTE Change:  %ld kB\n", vmpte_diff);
+        printf("--------------------------------------------------\n");
+        printf("NOTE: VmPTE reflects the *total* process page table size.\n");
+        printf("      The change observed is an *indicator*, not a precise measure\n");
+        printf("      of the overhead for *this specific mapping* alone.\n");
+        printf("      It can be influenced by THP, other allocations, etc.\n");
+        printf("--------------------------------------------------\n");
+    }
+
+    if (cgroup_parent) {
+        print_cgroup_mem_delta(&cgroup_run, huge_page_size, &cg_before, &cg_after);
+    }
+
+    // --- Calculate Theoretical Overheads ---
+    printf("\n--- Theoretical Overhead Calculation (Lowest Level Entries Only) ---\n");
+    size_t overhead_4k = calculate_overhead(map_size, PAGE_SIZE_4K);
+    printf("If using 4KB pages: %zu entries * %d bytes = %zu bytes (%.2f KB / %.2f MB)\n",
+           (map_size + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K, PTE_SIZE, overhead_4k,
+           (double)overhead_4k / 1024, (double)overhead_4k / (1024*1024));
+
+    if (map_size >= PAGE_SIZE_2M) {
+        size_t overhead_2m = calculate_overhead(map_size, PAGE_SIZE_2M);
+        printf("If using 2MB pages: %zu entries * %d bytes = %zu bytes (%.2f KB / %.2f MB)\n",
+               (map_size + PAGE_SIZE_2M - 1) / PAGE_SIZE_2M, PTE_SIZE, overhead_2m,
+               (double)overhead_2m / 1024, (double)overhead_2m / (1024*1024));
+    } else {
+        printf("If using 2MB pages: N/A (mapping size < 2MB)\n");
+    }
+
+    if (map_size >= PAGE_SIZE_1G) {
+        size_t overhead_1g = calculate_overhead(map_size, PAGE_SIZE_1G);
+        printf("If using 1GB pages: %zu entries * %d bytes = %zu bytes (%.2f KB / %.2f MB)\n",
+               (map_size + PAGE_SIZE_1G - 1) / PAGE_SIZE_1G, PTE_SIZE, overhead_1g,
+               (double)overhead_1g / 1024, (double)overhead_1g / (1024*1024));
+    } else {
+        printf("If using 1GB pages: N/A (mapping size < 1GB)\n");
+    }
+    printf("--------------------------------------------------\n");
+    printf("NOTE: These calculations show potential lowest-level entry overhead only.\n");
+    printf("      They don't include intermediate page directory costs.\n");
+    printf("      Actual overhead depends on kernel behavior (THP, etc.).\n");
+    printf("--------------------------------------------------\n");
+
+    printf("PID: %d - You may inspect `/proc/%d/smaps` now, then press Enter...\n", getpid(), getpid());
+    getchar();
+
+    // --- Cleanup ---
+    printf("\n--- Unmapping Memory ---\n");
+    unmap_region(addr, map_size, backing, region_fd);
 
     return 0;
 }